@@ -0,0 +1,33 @@
+#!/bin/sh
+
+# Rebuilds and reloads module in every build configuration, maps device
+# with preset and reports time dispatch path takes per event.
+#
+# usage: bench.sh ID PRESET [COUNT]
+
+id="$1"
+preset="$2"
+count="${3:-100000}"
+
+if [ -z "$id" ] || [ -z "$preset" ]; then
+  echo "usage: $0 ID PRESET [COUNT]" >&2
+  exit 1
+fi
+
+for config in "CONFIG_UNIJOY_STATS=y CONFIG_UNIJOY_TAP=y" \
+              "CONFIG_UNIJOY_STATS=n CONFIG_UNIJOY_TAP=y" \
+              "CONFIG_UNIJOY_STATS=y CONFIG_UNIJOY_TAP=n" \
+              "CONFIG_UNIJOY_STATS=n CONFIG_UNIJOY_TAP=n"; do
+  make clean > /dev/null
+  make $config > /dev/null || exit 1
+
+  rmmod unijoy 2> /dev/null
+  insmod ./unijoy.ko || exit 1
+  sh "$preset" > /dev/null
+
+  echo bench "$id" "$count" > /sys/unijoy_ctl/merger
+  printf '%s: ' "$config"
+  grep '^bench' /sys/unijoy_ctl/stats || echo "no result"
+done
+
+rmmod unijoy
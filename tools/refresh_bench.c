@@ -0,0 +1,481 @@
+/**
+ * Measures what mapping changes and hotplug of merged devices cost.
+ *
+ * Creates a uinput stand-in joystick, merges it and maps its buttons and
+ * axes one command at a time, then unmaps them and finally unplugs and
+ * plugs it back a number of times. For every step it reports wall time
+ * of the command write, number of uevents it caused and the longest gap
+ * between events seen by a reader of virtual input device (stand-in
+ * keeps moving its first axis every millisecond meanwhile).
+ *
+ * Time worker thread spends re-registering virtual device is read from
+ * module statistics at the end (needs module built with
+ * CONFIG_UNIJOY_STATS).
+ *
+ * Build with "make tools", run as root with module loaded:
+ *
+ *   ./tools/refresh_bench [-b BUTTONS] [-a AXES] [-s STORM] [-d SETTLE_MS]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <linux/netlink.h>
+
+#define MERGER "/sys/unijoy_ctl/merger"
+#define STATS "/sys/unijoy_ctl/stats"
+
+#define BENCH_BUS BUS_VIRTUAL
+#define BENCH_VENDOR 0x1209
+#define BENCH_PRODUCT 0x0a11
+#define BENCH_VERSION 1
+
+#define MAX_BUTTONS 32
+#define MAX_AXES 8
+#define UNPLUG_MS 10
+
+static int buttons = 16;
+static int axes = 4;
+static int storm = 10;
+static int settle_ms = 200;
+
+static unsigned long long id;
+
+static pthread_mutex_t uinput_lock = PTHREAD_MUTEX_INITIALIZER;
+static int uinput_fd = -1;
+
+static pthread_mutex_t gap_lock = PTHREAD_MUTEX_INITIALIZER;
+static long long gap_max;
+
+static volatile int stopping;
+
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+  nanosleep(&ts, 0);
+}
+
+static int command(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static int command(const char *fmt, ...) {
+  char buf[128];
+  va_list ap;
+  int fd, len;
+
+  va_start(ap, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  fd = open(MERGER, O_WRONLY);
+  if (fd < 0)
+    return -1;
+
+  len = write(fd, buf, len);
+  close(fd);
+
+  return len < 0 ? -1 : 0;
+}
+
+static int plug(void) {
+  struct uinput_user_dev dev;
+  int fd, i;
+
+  fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (fd < 0)
+    return -1;
+
+  memset(&dev, 0, sizeof(dev));
+  snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "unijoy refresh bench");
+  dev.id.bustype = BENCH_BUS;
+  dev.id.vendor = BENCH_VENDOR;
+  dev.id.product = BENCH_PRODUCT;
+  dev.id.version = BENCH_VERSION;
+
+  ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  for (i = 0; i < buttons; i++)
+    ioctl(fd, UI_SET_KEYBIT, BTN_JOYSTICK + i);
+
+  ioctl(fd, UI_SET_EVBIT, EV_ABS);
+  for (i = 0; i < axes; i++) {
+    ioctl(fd, UI_SET_ABSBIT, ABS_X + i);
+    dev.absmin[ABS_X + i] = -32768;
+    dev.absmax[ABS_X + i] = 32767;
+  }
+
+  if (write(fd, &dev, sizeof(dev)) != sizeof(dev) ||
+      ioctl(fd, UI_DEV_CREATE) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  pthread_mutex_lock(&uinput_lock);
+  uinput_fd = fd;
+  pthread_mutex_unlock(&uinput_lock);
+
+  return 0;
+}
+
+static void unplug(void) {
+  pthread_mutex_lock(&uinput_lock);
+  if (uinput_fd >= 0) {
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    uinput_fd = -1;
+  }
+  pthread_mutex_unlock(&uinput_lock);
+}
+
+/* Module lists every device it knows with its id first. */
+static int known(void) {
+  char buf[65536];
+  char needle[32];
+  int fd, len;
+
+  fd = open(MERGER, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = 0;
+
+  snprintf(needle, sizeof(needle), "%llu ", id);
+  return strstr(buf, needle) != 0;
+}
+
+static void *feeder(void *unused) {
+  struct input_event ev[2];
+  int value = 0;
+
+  memset(ev, 0, sizeof(ev));
+  ev[0].type = EV_ABS;
+  ev[0].code = ABS_X;
+  ev[1].type = EV_SYN;
+  ev[1].code = SYN_REPORT;
+
+  while (!stopping) {
+    value = value ? 0 : 1000;
+    ev[0].value = value;
+
+    pthread_mutex_lock(&uinput_lock);
+    if (uinput_fd >= 0 && write(uinput_fd, ev, sizeof(ev)) < 0)
+      perror("feeder");
+    pthread_mutex_unlock(&uinput_lock);
+
+    sleep_ms(1);
+  }
+
+  return 0;
+}
+
+/* Virtual device is re-created on refresh, so it is looked up by name. */
+static int find_virtual(void) {
+  char path[32];
+  char name[64];
+  int i, fd;
+
+  for (i = 0; i < 64; i++) {
+    snprintf(path, sizeof(path), "/dev/input/event%d", i);
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+      continue;
+    if (ioctl(fd, EVIOCGNAME(sizeof(name)), name) > 0 &&
+        strncmp(name, "unijoy v", 8) == 0)
+      return fd;
+    close(fd);
+  }
+
+  return -1;
+}
+
+static void *reader(void *unused) {
+  struct input_event ev[64];
+  struct pollfd pfd;
+  long long last = 0, now, gap;
+  int fd = -1;
+  int i, n;
+
+  while (!stopping) {
+    if (fd < 0) {
+      fd = find_virtual();
+      if (fd < 0) {
+        sleep_ms(1);
+        continue;
+      }
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+
+    n = read(fd, ev, sizeof(ev));
+    if (n <= 0) {
+      if (n < 0 && errno == EAGAIN)
+        continue;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+
+    now = now_ns();
+    for (i = 0; i < n / (int)sizeof(struct input_event); i++) {
+      if (ev[i].type != EV_ABS)
+        continue;
+      gap = last ? now - last : 0;
+      last = now;
+
+      pthread_mutex_lock(&gap_lock);
+      if (gap > gap_max)
+        gap_max = gap;
+      pthread_mutex_unlock(&gap_lock);
+    }
+  }
+
+  if (fd >= 0)
+    close(fd);
+
+  return 0;
+}
+
+static int uevent_socket(void) {
+  struct sockaddr_nl addr;
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int uevents_drain(int fd) {
+  char buf[8192];
+  int count = 0;
+
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    count++;
+
+  return count;
+}
+
+/* pause_ns is a deliberate pause within step, not counted as blackout */
+struct step {
+  long long total_ns;
+  long long max_ns;
+  long long gap_ns;
+  long long pause_ns;
+  int uevents;
+  int count;
+};
+
+static void step_begin(int uevents_fd) {
+  uevents_drain(uevents_fd);
+  pthread_mutex_lock(&gap_lock);
+  gap_max = 0;
+  pthread_mutex_unlock(&gap_lock);
+}
+
+static void step_end(struct step *step, int uevents_fd, long long spent) {
+  sleep_ms(settle_ms);
+
+  step->total_ns += spent;
+  if (spent > step->max_ns)
+    step->max_ns = spent;
+  step->uevents += uevents_drain(uevents_fd);
+
+  pthread_mutex_lock(&gap_lock);
+  if (gap_max - step->pause_ns > step->gap_ns)
+    step->gap_ns = gap_max - step->pause_ns;
+  pthread_mutex_unlock(&gap_lock);
+
+  step->count++;
+}
+
+static void step_print(const char *name, struct step *step) {
+  if (!step->count)
+    return;
+
+  printf("%-12s %5d %12lld %12lld %10.1f %12lld\n", name, step->count,
+         step->total_ns / step->count / 1000, step->max_ns / 1000,
+         (double)step->uevents / step->count, step->gap_ns / 1000);
+}
+
+static void print_refresh(void) {
+  char buf[4096];
+  char *line;
+  int fd, len;
+
+  fd = open(STATS, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return;
+  buf[len] = 0;
+
+  line = strstr(buf, "refresh ");
+  if (!line) {
+    printf("worker refresh timing is not available "
+           "(module built without CONFIG_UNIJOY_STATS)\n");
+    return;
+  }
+
+  *strchrnul(line, '\n') = 0;
+  printf("worker %s\n", line);
+}
+
+int main(int argc, char **argv) {
+  struct step add_button = {0}, add_axis = {0};
+  struct step del_button = {0}, del_axis = {0};
+  struct step hotplug = { .pause_ns = UNPLUG_MS * 1000000LL };
+  pthread_t feeder_thread, reader_thread;
+  long long start;
+  int uevents_fd;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "b:a:s:d:")) != -1) {
+    switch (opt) {
+      case 'b': buttons = atoi(optarg); break;
+      case 'a': axes = atoi(optarg); break;
+      case 's': storm = atoi(optarg); break;
+      case 'd': settle_ms = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-b BUTTONS] [-a AXES] [-s STORM] "
+                        "[-d SETTLE_MS]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (buttons < 1 || buttons > MAX_BUTTONS || axes < 1 || axes > MAX_AXES) {
+    fprintf(stderr, "1..%d buttons and 1..%d axes are supported\n",
+            MAX_BUTTONS, MAX_AXES);
+    return 1;
+  }
+
+  id = ((unsigned long long)BENCH_BUS << 48) |
+       ((unsigned long long)BENCH_VENDOR << 32) |
+       ((unsigned long long)BENCH_PRODUCT << 16) |
+       BENCH_VERSION;
+
+  uevents_fd = uevent_socket();
+  if (uevents_fd < 0) {
+    perror("uevent socket");
+    return 1;
+  }
+
+  if (plug()) {
+    perror("uinput");
+    return 1;
+  }
+
+  for (i = 0; i < 200 && !known(); i++)
+    sleep_ms(10);
+  if (!known()) {
+    fprintf(stderr, "stand-in device %llu did not show up in " MERGER "\n",
+            id);
+    unplug();
+    return 1;
+  }
+
+  command("unmerge %llu", id);
+  command("merge %llu", id);
+
+  pthread_create(&feeder_thread, 0, feeder, 0);
+  pthread_create(&reader_thread, 0, reader, 0);
+
+  for (i = 0; i < axes; i++) {
+    step_begin(uevents_fd);
+    start = now_ns();
+    command("add_axis %llu %d %d", id, i, i);
+    step_end(&add_axis, uevents_fd, now_ns() - start);
+  }
+
+  for (i = 0; i < buttons; i++) {
+    step_begin(uevents_fd);
+    start = now_ns();
+    command("add_button %llu %d %d", id, i, i);
+    step_end(&add_button, uevents_fd, now_ns() - start);
+  }
+
+  for (i = 0; i < storm; i++) {
+    step_begin(uevents_fd);
+    start = now_ns();
+    unplug();
+    sleep_ms(UNPLUG_MS);
+    if (plug()) {
+      perror("uinput");
+      break;
+    }
+    step_end(&hotplug, uevents_fd, now_ns() - start);
+  }
+
+  for (i = buttons - 1; i >= 0; i--) {
+    step_begin(uevents_fd);
+    start = now_ns();
+    command("del_button %d", i);
+    step_end(&del_button, uevents_fd, now_ns() - start);
+  }
+
+  /*
+   * Axis 0 carries movements of stand-in the blackout is measured by, so
+   * it stays mapped until unmerge.
+   */
+  for (i = axes - 1; i > 0; i--) {
+    step_begin(uevents_fd);
+    start = now_ns();
+    command("del_axis %d", i);
+    step_end(&del_axis, uevents_fd, now_ns() - start);
+  }
+
+  stopping = 1;
+  pthread_join(feeder_thread, 0);
+  pthread_join(reader_thread, 0);
+
+  printf("%-12s %5s %12s %12s %10s %12s\n", "step", "count", "avg_us",
+         "max_us", "uevents", "blackout_us");
+  step_print("add_axis", &add_axis);
+  step_print("add_button", &add_button);
+  step_print("hotplug", &hotplug);
+  step_print("del_button", &del_button);
+  step_print("del_axis", &del_axis);
+  print_refresh();
+
+  command("unmerge %llu", id);
+  unplug();
+  close(uevents_fd);
+
+  return 0;
+}
@@ -13,7 +13,8 @@
  * in "echo merge ID > /sys/unijoy_ctl/merger").
  *
  * echo merge ID
- *     adds a specified ID to merge (union of devices)
+ *     adds a specified ID to merge (union of devices). Device is actually
+ *     opened only while at least one of its buttons or axes is mapped.
  *
  * echo unmerge ID
  *     removes a specified ID from merge
@@ -31,6 +32,115 @@
  *
  * del_axis DEST_AXIS_NO
  *     likewise del_button, only for axis
+ *
+ * policy ID POLICY_NO
+ *     selects what happens to axes of merged device upon its unplugging:
+ *     0 centers them (default), 1 holds last reported values. Buttons are
+ *     always released. Virtual device is never re-registered on hotplug.
+ *
+ * range DEST_AXIS_NO [IN_MIN IN_MAX [INVERT]]
+ *     stretches IN_MIN..IN_MAX window of source axis (in -32768..32767
+ *     units) to full range of destination axis, optionally inverting it.
+ *     Mapping one source axis to several destinations with different
+ *     windows splits it. Without window, mapping is restored to copying.
+ *
+ * trim DEST_AXIS_NO [ID UP_BUTTON_NO DOWN_BUTTON_NO [CENTER_BUTTON_NO [STEP]]]
+ *     adds offset to destination axis, nudged by STEP (256 by default)
+ *     with presses of source buttons of ID, CENTER_BUTTON_NO resets it.
+ *     Axis is re-emitted upon every nudge. Without buttons, trim is
+ *     removed.
+ *
+ * filter DEST_AXIS_NO TYPE [PARAM1 [PARAM2]]
+ *     smooths values of destination axis: type 0 disables filtering,
+ *     1 is exponential moving average with PARAM1 shift (1..8), 2 is median
+ *     of last PARAM1 (3 or 5) values, 3 is adaptive filter averaging with
+ *     PARAM1 shift at rest and less the faster axis moves, PARAM2 (0..15)
+ *     shifts speed down before that.
+ *
+ * motion DEST_AXIS_NO RATE [INTEGRATE [SHIFT]]
+ *     decimates destination axis fed by motion sensor (or anything else
+ *     reporting too often) to at most RATE (1..1000) values per second,
+ *     averaging samples in between. With INTEGRATE, samples (of gyro)
+ *     are integrated over time into angle, shifted right by SHIFT (0..30,
+ *     16 by default) bits. RATE 0 disables it.
+ *
+ * behaviour DEST_BUTTON_NO TYPE [PARAM1 [PARAM2 [PARAM3]]]
+ *     makes destination button behave on its own, timed by hrtimers:
+ *     type 0 passes button through (default), 1 toggles it upon every
+ *     press, 2 presses it for PARAM1 ms, 3 repeats it at PARAM1 Hz
+ *     while held, 4 plays PARAM3 presses of PARAM1 ms with PARAM2 ms
+ *     pauses between them.
+ *
+ * program 0|1 DEST_NO [OPCODE OPERAND]...
+ *     replaces value of destination axis (0) or button (1) with result of
+ *     a small stack program, evaluated upon every dispatched event. Its
+ *     instructions may read value destination would get otherwise, as
+ *     well as current values of any destinations. Program is verified
+ *     upon upload: at most 32 instructions, no jumps, stack never under-
+ *     or overflows and leaves exactly one value. Without instructions,
+ *     program is removed. See README.md for opcodes.
+ *
+ * share 0|1 DEST_NO POLICY [PARAM]
+ *     lets destination axis (0) or button (1) be fed by several source
+ *     axes or buttons, added to it with add_axis or add_button (up to
+ *     four). Policy 1 follows the last one moved, unless another one moved
+ *     within PARAM ms, 2 follows the most deflected one, 3 follows the
+ *     first one in order of adding deflected more than PARAM, 4 (buttons
+ *     only) presses destination while any of them is pressed. Policy 0
+ *     drops sharing, along with all but the first source. Every joined
+ *     axis is calibrated by its own source, but filter and motion state
+ *     of destination is shared by all of them, so policies 1 and 2
+ *     compare values already smoothed together with the other sources.
+ *
+ * exclusive ID 0|1
+ *     grabs merged device exclusively, so its events are delivered only to
+ *     virtual device and not to other handlers (evdev, joydev) of it.
+ *
+ * Runtime statistics are available for reading from /sys/unijoy_ctl/stats.
+ *
+ * Loading module with keyboards=1 makes it attach to keyboards (and button
+ * boxes enumerating as ones) too, their keys are numbered after buttons.
+ *
+ * Loading module with allow=ID,VENDOR:PRODUCT,... attaches it only to
+ * listed devices (PRODUCT may be *), the rest are only listed as IGNORED.
+ *
+ * Besides of virtual input device (which gets its own jsN from joydev),
+ * module can serve joystick device of its own, fed directly from event
+ * handler, when loaded with js_device=1. Loading module with
+ * input_device=0 then leaves only that one, so games would not see
+ * merged input twice.
+ *
+ * With statistics built in, frame rate, interval jitter and gaps longer
+ * than gap_ms between frames of moving devices are tracked per source.
+ *
+ * Worker thread is watched: when it keeps queued events waiting for more
+ * than watchdog_ms, module reports it as stalled. With degraded_direct=1
+ * queued events are then drained by a high priority work item instead,
+ * unless worker is stuck re-registering virtual device.
+ *
+ * Instrumentation is selected upon build (see Makefile): without
+ * CONFIG_UNIJOY_STATS queue depth, latency and reconnect statistics are
+ * not collected, without CONFIG_UNIJOY_TAP there is no event tap. Optional
+ * transforms cost a single patched-out branch while not configured.
+ *
+ * echo bench ID COUNT
+ *     feeds COUNT synthetic events of first mapped axis (or button) of ID
+ *     through dispatch path and reports average time it took per event in
+ *     statistics. Events do reach virtual device.
+ *
+ * With idle_timeout set, worker goes idle once no button was touched and
+ * no axis moved by more than idle_threshold for that many seconds: it is
+ * not woken by every event anymore and drains axes ten times a second,
+ * until the first significant event wakes it up again.
+ *
+ * Memory used by module, by category and with peak values, is reported
+ * in unijoy/memory file of debugfs.
+ *
+ * Current state of virtual device can be mmap-ed read-only from
+ * /dev/unijoy_state, see unijoy.h for its layout.
+ *
+ * Stream of all dispatched events can be followed through ring mmap-ed
+ * from /dev/unijoy_tap (single consumer at a time), see unijoy.h too.
  */
 
 #include <linux/kernel.h>
@@ -41,24 +151,208 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/ctype.h>
-
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/math64.h>
+#include <linux/hrtimer.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/compat.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "unijoy.h"
+
+#define UNIJOY_NAME "unijoy v0.3"
 #define UNIJOY_MINOR_BASE 0
 #define UNIJOY_MINORS 16
 #define UNIJOY_BUFFER_SIZE 128
 #define UNIJOY_MAX_BUTTONS (KEY_MAX - BTN_MISC + 1)
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+#define smp_load_acquire(p) \
+  ({ typeof(*(p)) ___p = ACCESS_ONCE(*(p)); smp_mb(); ___p; })
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+struct static_key_false {
+  bool enabled;
+};
+#define DEFINE_STATIC_KEY_FALSE(name) struct static_key_false name
+#define static_branch_unlikely(key) unlikely(ACCESS_ONCE((key)->enabled))
+#define static_branch_enable(key) ((key)->enabled = true)
+#define static_branch_disable(key) ((key)->enabled = false)
+#endif
+
+/* Optional stages of dispatch path, enabled only while configured. */
+static DEFINE_STATIC_KEY_FALSE(unijoy_trim_key);
+static DEFINE_STATIC_KEY_FALSE(unijoy_program_key);
+static DEFINE_STATIC_KEY_FALSE(unijoy_share_key);
+static DEFINE_STATIC_KEY_FALSE(unijoy_motion_key);
+
+static bool unijoy_input_device = true;
+module_param_named(input_device, unijoy_input_device, bool, 0444);
+MODULE_PARM_DESC(input_device, "Register virtual input device "
+                               "(default: true)");
+
+static bool unijoy_js_device;
+module_param_named(js_device, unijoy_js_device, bool, 0444);
+MODULE_PARM_DESC(js_device, "Serve own joystick device fed directly from "
+                            "event handler (default: false)");
+
+static unsigned int unijoy_watchdog_ms = 250;
+module_param_named(watchdog_ms, unijoy_watchdog_ms, uint, 0444);
+MODULE_PARM_DESC(watchdog_ms, "Time queued events may wait for worker thread "
+                              "before it is considered stalled, 0 disables "
+                              "watchdog (default: 250)");
+
+static unsigned int unijoy_idle_timeout;
+module_param_named(idle_timeout, unijoy_idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout, "Seconds without significant input before "
+                               "worker goes idle, 0 disables idling "
+                               "(default: 0)");
+
+static unsigned int unijoy_idle_threshold = 512;
+module_param_named(idle_threshold, unijoy_idle_threshold, uint, 0644);
+MODULE_PARM_DESC(idle_threshold, "Axis movement considered significant "
+                                 "input (default: 512)");
+
+static unsigned int unijoy_gap_ms = 25;
+module_param_named(gap_ms, unijoy_gap_ms, uint, 0644);
+MODULE_PARM_DESC(gap_ms, "Interval between frames of a moving device "
+                         "counted as a gap, 0 disables counting "
+                         "(default: 25)");
+
+static bool unijoy_keyboards;
+module_param_named(keyboards, unijoy_keyboards, bool, 0444);
+MODULE_PARM_DESC(keyboards, "Attach to keyboards too, so their keys can be "
+                            "mapped to buttons (default: false)");
+
+#define UNIJOY_ALLOW_MAX 16
+
+static char *unijoy_allow[UNIJOY_ALLOW_MAX];
+static int unijoy_allow_count;
+module_param_array_named(allow, unijoy_allow, charp, &unijoy_allow_count,
+                         0444);
+MODULE_PARM_DESC(allow, "Devices to attach to, by ID or as VENDOR:PRODUCT "
+                        "in hex (PRODUCT may be *), all joysticks are "
+                        "attached to if not given");
+
+static bool unijoy_degraded_direct;
+module_param_named(degraded_direct, unijoy_degraded_direct, bool, 0644);
+MODULE_PARM_DESC(degraded_direct, "Drain queued events from a work item "
+                                  "while worker is stalled (default: false)");
+
 /* Threads */
 
+struct unijoy_thread_data {
+  __u16 action;
+  __u16 number;
+  __s32 value;
+  ktime_t time;
+};
+
 static int unijoy_thread(void *);
-static __u64 unijoy_thread_nextdata(void);
+static bool unijoy_thread_nextdata(struct unijoy_thread_data *);
 static int unijoy_thread_wakeup_condition(void);
+static bool unijoy_thread_pending(void);
+static void unijoy_thread_timestamp(ktime_t);
+#ifdef CONFIG_UNIJOY_STATS
+static void unijoy_thread_account(int, ktime_t);
+#endif
+static void unijoy_thread_refresh(void);
+static void unijoy_thread_process(struct unijoy_thread_data *, int);
+static void unijoy_thread_drain_axes(void);
+static void unijoy_thread_step(void);
+static long unijoy_thread_timeout(void);
+static void unijoy_thread_idle(void);
+
+#define UNIJOY_IDLE_POLL (HZ / 10)
+
+enum unijoy_thread_lane {
+  UNIJOY_LANE_MAIN,
+  UNIJOY_LANE_AXIS,
+  UNIJOY_LANE_CNT
+};
+
+#ifdef CONFIG_UNIJOY_STATS
+static char *unijoy_thread_lane_names[] = {
+  "main",
+  "axis"
+};
+#endif
+
+struct unijoy_thread_lane_stats {
+  int depth_max;
+  u64 dropped;
+  u64 latency_total;
+  u64 latency_max;
+  u64 latency_count;
+};
+
+struct unijoy_thread_refresh_stats {
+  u64 count;
+  u64 skipped;
+  u64 unregister_total;
+  u64 unregister_max;
+  u64 register_total;
+  u64 register_max;
+};
 
 enum unijoy_thread_action {
   UNIJOY_ACTION_EMMIT_BUTTON,
-  UNIJOY_ACTION_EMMIT_AXIS,
-  UNIJOY_ACTION_REFRESH
+  UNIJOY_ACTION_REFRESH,
+  UNIJOY_ACTION_REPORT_BUTTON,
+  UNIJOY_ACTION_REPORT_AXIS,
+  UNIJOY_ACTION_SYNC
+};
+
+/* Watchdog */
+
+enum unijoy_watchdog_health {
+  UNIJOY_HEALTH_OK,
+  UNIJOY_HEALTH_STALLED
+};
+
+static char *unijoy_watchdog_health_names[] = {
+  "ok",
+  "stalled"
 };
 
+static struct {
+  struct hrtimer timer;
+  enum unijoy_watchdog_health health;
+  unsigned long drains_seen;
+  bool pending_seen;
+  s64 stalled_since;
+  unsigned int stalls;
+  s64 stall_max;
+  u64 direct;
+  struct work_struct work;
+  bool stopped;
+} unijoy_watchdog;
+
+static void unijoy_watchdog_setup(void);
+static void unijoy_watchdog_free(void);
+static enum hrtimer_restart unijoy_watchdog_tick(struct hrtimer *);
+static void unijoy_watchdog_kick(void);
+static void unijoy_watchdog_work(struct work_struct *);
+
 /* Input handlers */
 
 enum unijoy_inph_state {
@@ -73,6 +367,11 @@ static char *unijoy_inph_state_names[] = {
   "DISCONNECTED"
 };
 
+enum unijoy_inph_policy {
+  UNIJOY_POLICY_CENTER,
+  UNIJOY_POLICY_HOLD
+};
+
 static char *unijoy_inph_mapping_names[] = {
   " ONLINE",
   "OFFLINE"
@@ -85,18 +384,230 @@ struct unijoy_inph_source {
   int axis_total;
   int buttons_total;
   enum unijoy_inph_state state;
+  enum unijoy_inph_policy policy;
+  bool exclusive;
+  bool grabbed;
+  bool opened;
+  bool trimming;
+  unsigned int reconnects;
+  s64 resumed_at;
+  s64 reconnect_latency;
+  u64 frames;
+  s64 frame_at;
+  s64 interval_avg;
+  s64 interval_dev;
+  s64 interval_max;
+  unsigned int gaps;
   struct input_handle handle;
-  __u16 button_map[UNIJOY_MAX_BUTTONS];
-  __u16 button_revmap[UNIJOY_MAX_BUTTONS];
+  DECLARE_BITMAP(mapped_keys, KEY_CNT);
+  DECLARE_BITMAP(mapped_abs, ABS_CNT);
+  __u16 button_map[KEY_CNT];
+  __u16 button_revmap[KEY_CNT];
   __u8 axis_map[ABS_CNT];
   __u8 axis_revmap[ABS_CNT];
   struct js_corr corrections[ABS_CNT];
 };
 
+enum unijoy_inph_filter_type {
+  UNIJOY_FILTER_NONE,
+  UNIJOY_FILTER_EMA,
+  UNIJOY_FILTER_MEDIAN,
+  UNIJOY_FILTER_ADAPTIVE
+};
+
+#define UNIJOY_FILTER_MAX_SHIFT 8
+#define UNIJOY_FILTER_MAX_WINDOW 5
+#define UNIJOY_FILTER_FRACTION 8
+
+struct unijoy_inph_filter {
+  enum unijoy_inph_filter_type type;
+  __u8 shift;
+  __u8 window;
+  __u8 beta;
+  __u8 pos;
+  bool primed;
+  __s32 acc;
+  __s16 samples[UNIJOY_FILTER_MAX_WINDOW];
+};
+
+#define UNIJOY_MOTION_MAX_RATE 1000
+#define UNIJOY_MOTION_SHIFT 16
+#define UNIJOY_MOTION_MAX_SHIFT 30
+
+struct unijoy_inph_motion {
+  int rate;
+  bool integrate;
+  int shift;
+  s64 period;
+  s64 emitted;
+  s64 sampled;
+  s64 sum;
+  int count;
+  s64 angle;
+};
+
+enum unijoy_inph_behaviour_type {
+  UNIJOY_BEHAVIOUR_NONE,
+  UNIJOY_BEHAVIOUR_TOGGLE,
+  UNIJOY_BEHAVIOUR_PULSE,
+  UNIJOY_BEHAVIOUR_TURBO,
+  UNIJOY_BEHAVIOUR_SEQUENCE
+};
+
+#define UNIJOY_BEHAVIOUR_MAX_MS 10000
+#define UNIJOY_BEHAVIOUR_MAX_HZ 100
+#define UNIJOY_BEHAVIOUR_MAX_COUNT 100
+
+struct unijoy_inph_behaviour {
+  enum unijoy_inph_behaviour_type type;
+  int params[3];
+  ktime_t on;
+  ktime_t off;
+  int left;
+  bool held;
+  bool state;
+  struct hrtimer timer;
+};
+
+#define UNIJOY_TRIM_STEP 256
+#define UNIJOY_TRIM_MAX_STEP 4096
+
+struct unijoy_inph_trim {
+  struct unijoy_inph_source *source;
+  __u64 id;
+  bool enabled;
+  int up;
+  int down;
+  int center;
+  int step;
+  int offset;
+  int base;
+};
+
+enum unijoy_inph_opcode {
+  UNIJOY_OP_INPUT,
+  UNIJOY_OP_PUSH,
+  UNIJOY_OP_AXIS,
+  UNIJOY_OP_BUTTON,
+  UNIJOY_OP_ADD,
+  UNIJOY_OP_SUB,
+  UNIJOY_OP_MUL,
+  UNIJOY_OP_SHR,
+  UNIJOY_OP_NEG,
+  UNIJOY_OP_ABS,
+  UNIJOY_OP_MIN,
+  UNIJOY_OP_MAX,
+  UNIJOY_OP_GT,
+  UNIJOY_OP_LT,
+  UNIJOY_OP_AND,
+  UNIJOY_OP_OR,
+  UNIJOY_OP_NOT,
+  UNIJOY_OP_SELECT,
+  UNIJOY_OP_CNT
+};
+
+/* Values every opcode pops, all of them push a single one back. */
+static const __u8 unijoy_inph_opcode_pops[UNIJOY_OP_CNT] = {
+  [UNIJOY_OP_INPUT]  = 0,
+  [UNIJOY_OP_PUSH]   = 0,
+  [UNIJOY_OP_AXIS]   = 0,
+  [UNIJOY_OP_BUTTON] = 0,
+  [UNIJOY_OP_ADD]    = 2,
+  [UNIJOY_OP_SUB]    = 2,
+  [UNIJOY_OP_MUL]    = 2,
+  [UNIJOY_OP_SHR]    = 1,
+  [UNIJOY_OP_NEG]    = 1,
+  [UNIJOY_OP_ABS]    = 1,
+  [UNIJOY_OP_MIN]    = 2,
+  [UNIJOY_OP_MAX]    = 2,
+  [UNIJOY_OP_GT]     = 2,
+  [UNIJOY_OP_LT]     = 2,
+  [UNIJOY_OP_AND]    = 2,
+  [UNIJOY_OP_OR]     = 2,
+  [UNIJOY_OP_NOT]    = 1,
+  [UNIJOY_OP_SELECT] = 3
+};
+
+#define UNIJOY_PROGRAM_MAX_INSNS 32
+#define UNIJOY_PROGRAM_STACK 8
+#define UNIJOY_MAX_PROGRAMS 16
+
+struct unijoy_inph_insn {
+  __u8 op;
+  __s32 arg;
+};
+
+struct unijoy_inph_program {
+  bool active;
+  bool button;
+  int number;
+  int length;
+  int input;
+  int last;
+  struct unijoy_inph_insn code[UNIJOY_PROGRAM_MAX_INSNS];
+};
+
+enum unijoy_inph_share_policy {
+  UNIJOY_SHARE_NONE,
+  UNIJOY_SHARE_LATEST,
+  UNIJOY_SHARE_DEFLECTION,
+  UNIJOY_SHARE_PRIORITY,
+  UNIJOY_SHARE_ANY,
+  UNIJOY_SHARE_CNT
+};
+
+#define UNIJOY_SHARE_MAX_INPUTS 4
+#define UNIJOY_SHARE_MAX_HOLD_MS 10000
+#define UNIJOY_MAX_SHARES 16
+
+struct unijoy_inph_input {
+  struct unijoy_inph_source *source;
+  __u64 id;
+  int value;
+};
+
+/*
+ * The first input of shared destination is its own mapping, the rest
+ * are joined to it, values[] holds last value of every one of them.
+ */
+struct unijoy_inph_share {
+  enum unijoy_inph_share_policy policy;
+  bool button;
+  int number;
+  int param;
+  s64 hold;
+  int extras;
+  struct unijoy_inph_input extra[UNIJOY_SHARE_MAX_INPUTS - 1];
+  int values[UNIJOY_SHARE_MAX_INPUTS];
+  int owner;
+  ktime_t moved;
+  int last;
+};
+
+#define UNIJOY_RANGE_FRACTION 16
+
+enum unijoy_inph_handler {
+  UNIJOY_HANDLER_COPY,
+  UNIJOY_HANDLER_LINEAR,
+  UNIJOY_HANDLER_RANGED,
+  UNIJOY_HANDLER_COMBINED,
+  UNIJOY_HANDLER_BEHAVIOUR,
+  UNIJOY_HANDLER_CNT
+};
+
 struct unijoy_inph_map {
   struct unijoy_inph_source *source;
   int value;
   __u64 id;
+  __u8 handler;
+  __u8 program;
+  __u8 share;
+  bool ranged;
+  bool invert;
+  int range_min;
+  int range_max;
+  __s64 scale;
+  __s64 offset;
 };
 
 static struct {
@@ -104,14 +615,40 @@ static struct {
   int buttons_total;
   struct unijoy_inph_map source_axis_map[ABS_CNT];
   struct unijoy_inph_map source_buttons_map[UNIJOY_MAX_BUTTONS];
+  struct unijoy_inph_filter filters[ABS_CNT];
+  struct unijoy_inph_motion motions[ABS_CNT];
+  struct unijoy_inph_trim trims[ABS_CNT];
+  struct unijoy_inph_behaviour behaviours[UNIJOY_MAX_BUTTONS];
+  spinlock_t behaviour_lock;
+  struct unijoy_inph_program programs[UNIJOY_MAX_PROGRAMS];
+  int programs_active;
+  spinlock_t program_lock;
+  struct unijoy_inph_share shares[UNIJOY_MAX_SHARES];
+  int shares_active;
+  spinlock_t share_lock;
   struct input_dev *idev;
   wait_queue_head_t wait;
   struct task_struct *thread;
   spinlock_t buffer_lock;
-  __u64 buffer[UNIJOY_BUFFER_SIZE];
+  struct unijoy_thread_data buffer[UNIJOY_BUFFER_SIZE];
   int head;
   int tail;
   bool full;
+  DECLARE_BITMAP(axis_pending, ABS_CNT);
+  int axis_pending_count;
+  __s32 axis_value[ABS_CNT];
+  __s16 dst_axis[ABS_CNT];
+  __u8 dst_buttons[UNIJOY_MAX_BUTTONS];
+  ktime_t axis_time[ABS_CNT];
+  unsigned long drains;
+  struct mutex emit_lock;
+  bool idle;
+  unsigned long active_at;
+  __s32 idle_ref[ABS_CNT];
+  unsigned int idles;
+  unsigned int resumes;
+  struct unijoy_thread_lane_stats lanes[UNIJOY_LANE_CNT];
+  struct unijoy_thread_refresh_stats refresh;
 } output;
 
 static void unijoy_inph_event(struct input_handle *, 
@@ -121,6 +658,8 @@ static void unijoy_inph_event(struct input_handle *,
 
 static bool unijoy_inph_match(struct input_handler *,
                               struct input_dev *);
+static bool unijoy_inph_kbd_match(struct input_handler *,
+                                  struct input_dev *);
 
 static int unijoy_inph_connect(struct input_handler *,
                                struct input_dev *,
@@ -131,11 +670,89 @@ static struct unijoy_inph_source *unijoy_inph_create(struct input_dev *,
 
 static void unijoy_inph_disconnect(struct input_handle *);
 static int unijoy_inph_correct(int, struct js_corr *);
+static int unijoy_inph_filter(struct unijoy_inph_filter *, int);
+static bool unijoy_inph_motion(struct unijoy_inph_motion *, int *, ktime_t);
+static int unijoy_inph_range(struct unijoy_inph_map *, int);
+static int unijoy_inph_trimmed(struct unijoy_inph_trim *, int);
+static void unijoy_inph_trim(struct unijoy_inph_source *, int, ktime_t);
+static int unijoy_inph_eval(struct unijoy_inph_program *);
+static void unijoy_inph_run(ktime_t);
+static bool unijoy_inph_resolve(struct unijoy_inph_share *, int, int *,
+                                ktime_t);
+static bool unijoy_inph_resolve_locked(struct unijoy_inph_share *, int, int *,
+                                       ktime_t);
+static void unijoy_inph_share(struct unijoy_inph_source *, unsigned int,
+                              unsigned int, int, int, ktime_t);
 static void unijoy_inph_unregister(void);
 static void unijoy_inph_register(void);
+static void unijoy_inph_capabilities(unsigned long *, unsigned long *,
+                                     unsigned long *);
+static bool unijoy_inph_unchanged(void);
 static void unijoy_inph_refresh(void);
+static void unijoy_inph_release(int, int);
 static void unijoy_inph_relink(struct unijoy_inph_source *, __u64);
-static void unijoy_inph_enqueue(__u64);
+static void unijoy_inph_enqueue(int, int, int, ktime_t);
+static void unijoy_inph_enqueue_axis(int, int, ktime_t);
+static void unijoy_inph_cancel_axis(int);
+static ktime_t unijoy_inph_timestamp(struct input_dev *);
+#ifdef CONFIG_UNIJOY_STATS
+static void unijoy_inph_frame(struct unijoy_inph_source *, ktime_t);
+
+#define UNIJOY_FRAME_REST_MS 1000
+#endif
+static void unijoy_inph_wake(bool);
+static void unijoy_inph_report(int, int, int);
+static int unijoy_inph_button_code(int);
+static void unijoy_inph_select_button(int);
+static void unijoy_inph_select_axis(int);
+static void unijoy_inph_button_copy(int, int, ktime_t);
+static void unijoy_inph_behave(int, int, ktime_t);
+static int unijoy_inph_axis_copy(int, struct js_corr *, int);
+static int unijoy_inph_axis_linear(int, struct js_corr *, int);
+static int unijoy_inph_axis_ranged(int, struct js_corr *, int);
+static int unijoy_inph_axis_combined(int, struct js_corr *, int);
+static void unijoy_inph_behaviour_emit(struct unijoy_inph_behaviour *,
+                                       int, ktime_t);
+static void unijoy_inph_behaviour_stop(int);
+static enum hrtimer_restart unijoy_inph_behaviour_timer(struct hrtimer *);
+
+#define UNIJOY_IGNORED_MAX 16
+#define UNIJOY_IGNORED_NAME 48
+
+struct unijoy_inph_allow {
+  __u64 id;
+  int vendor;
+  int product;
+};
+
+struct unijoy_inph_ignored {
+  __u64 id;
+  int axis_total;
+  int buttons_total;
+  char name[UNIJOY_IGNORED_NAME];
+};
+
+/*
+ * Devices outside of allowlist are rejected by .match, before any handle
+ * or source is allocated, and only remembered for listing (the latest
+ * UNIJOY_IGNORED_MAX of them).
+ */
+static struct {
+  struct unijoy_inph_allow entries[UNIJOY_ALLOW_MAX];
+  int total;
+  struct unijoy_inph_ignored ignored[UNIJOY_IGNORED_MAX];
+  int ignored_total;
+  int ignored_next;
+} unijoy_allowlist;
+
+static int unijoy_inph_allowlist(void);
+static bool unijoy_inph_allowed(struct input_dev *);
+static void unijoy_inph_ignore(struct input_dev *);
+static __u64 unijoy_inph_id(struct input_dev *);
+static bool unijoy_inph_joystick(struct input_dev *);
+static bool unijoy_inph_keyboard(struct input_dev *);
+
+#define UNIJOY_ID_MOTION (1ULL << 63)
 
 static const struct input_device_id unijoy_inph_ids[] = {
 	{
@@ -156,6 +773,13 @@ static const struct input_device_id unijoy_inph_ids[] = {
 		.evbit = { BIT_MASK(EV_ABS) },
 		.absbit = { BIT_MASK(ABS_THROTTLE) },
 	},
+	/* Gyros of controllers may report rotation axes only */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { BIT_MASK(ABS_RX) },
+	},
 	{
 		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
 			INPUT_DEVICE_ID_MATCH_KEYBIT,
@@ -179,6 +803,32 @@ static const struct input_device_id unijoy_inph_ids[] = {
 
 MODULE_DEVICE_TABLE(input, unijoy_inph_ids);
 
+/*
+ * Keyboards are attached by a handler of their own, registered only with
+ * keyboards=1, so unijoy_inph_ids (and module alias) stays joystick-only.
+ */
+static const struct input_device_id unijoy_inph_kbd_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ }
+};
+
+static void (*const unijoy_inph_button_handlers[UNIJOY_HANDLER_CNT])
+  (int, int, ktime_t) = {
+  [UNIJOY_HANDLER_COPY]      = unijoy_inph_button_copy,
+  [UNIJOY_HANDLER_BEHAVIOUR] = unijoy_inph_behave
+};
+
+static int (*const unijoy_inph_axis_handlers[UNIJOY_HANDLER_CNT])
+  (int, struct js_corr *, int) = {
+  [UNIJOY_HANDLER_COPY]     = unijoy_inph_axis_copy,
+  [UNIJOY_HANDLER_LINEAR]   = unijoy_inph_axis_linear,
+  [UNIJOY_HANDLER_RANGED]   = unijoy_inph_axis_ranged,
+  [UNIJOY_HANDLER_COMBINED] = unijoy_inph_axis_combined
+};
+
 static struct input_handler unijoy_inph = {
   .event         = unijoy_inph_event,
   .match         = unijoy_inph_match,
@@ -190,6 +840,15 @@ static struct input_handler unijoy_inph = {
   .id_table      = unijoy_inph_ids
 };
 
+static struct input_handler unijoy_inph_kbd = {
+  .event         = unijoy_inph_event,
+  .match         = unijoy_inph_kbd_match,
+  .connect       = unijoy_inph_connect,
+  .disconnect    = unijoy_inph_disconnect,
+  .name          = "unijoy_kbd",
+  .id_table      = unijoy_inph_kbd_ids
+};
+
 /* Sysfs operations */
 
 static int unijoy_sysfs_setup(void);
@@ -197,6 +856,26 @@ static void unijoy_sysfs_free(void);
 static struct unijoy_inph_source *unijoy_sysfs_find(__u64);
 static void unijoy_sysfs_remove(struct unijoy_inph_source *);
 static void unijoy_sysfs_suspend(struct unijoy_inph_source *);
+static void unijoy_sysfs_resume(struct unijoy_inph_source *);
+static void unijoy_sysfs_neutralize(struct unijoy_inph_source *);
+static void unijoy_sysfs_policy(struct unijoy_inph_source *, int);
+static void unijoy_sysfs_exclusive(struct unijoy_inph_source *, int);
+static void unijoy_sysfs_filter(int, int, int, int);
+static void unijoy_sysfs_motion(int, int, int, int);
+static void unijoy_sysfs_range(int, int, int, bool, bool);
+static void unijoy_sysfs_behaviour(int, int, int, int, int);
+static void unijoy_sysfs_trim(int, struct unijoy_inph_source *,
+                              int, int, int, int);
+static void unijoy_sysfs_program(char *);
+static void unijoy_sysfs_share(int, int, int, int);
+static void unijoy_sysfs_join(struct unijoy_inph_share *,
+                              struct unijoy_inph_source *, int);
+static void unijoy_sysfs_leave(struct unijoy_inph_map *);
+static void unijoy_sysfs_keys(void);
+static void unijoy_sysfs_bench(struct unijoy_inph_source *, int);
+static bool unijoy_sysfs_verify(struct unijoy_inph_insn *, int);
+static void unijoy_sysfs_grab(struct unijoy_inph_source *);
+static void unijoy_sysfs_update(struct unijoy_inph_source *);
 static void unijoy_sysfs_merge(struct unijoy_inph_source *);
 static void unijoy_sysfs_unmerge(struct unijoy_inph_source *);
 static void unijoy_sysfs_add_button(struct unijoy_inph_source *, int, int);
@@ -205,6 +884,7 @@ static void unijoy_sysfs_add_axis(struct unijoy_inph_source *, int, int);
 static void unijoy_sysfs_del_axis(int);
 static void unijoy_sysfs_clean(struct unijoy_inph_source *, bool);
 static ssize_t unijoy_sysfs_show(struct kobject *, struct attribute *, char *);
+static ssize_t unijoy_sysfs_show_stats(char *);
 static ssize_t unijoy_sysfs_store(struct kobject *, struct attribute *,
                                   const char *, size_t);
 
@@ -224,8 +904,14 @@ static struct sysfs_ops unijoy_sysfs_ops = {
   .store = unijoy_sysfs_store
 };
 
+static struct attribute unijoy_sysfs_stats = {
+  .name = "stats",
+  .mode = 0444
+};
+
 static struct attribute * unijoy_sysfs_attrs[] = {
   &unijoy_sysfs.attr,
+  &unijoy_sysfs_stats,
   0
 };
 
@@ -236,6 +922,175 @@ static struct kobj_type unijoy_sysfs_kobj_type = {
 
 static struct kobject *unijoy_sysfs_kobject;
 
+#define UNIJOY_BENCH_MAX 1000000
+#define UNIJOY_BENCH_BATCH 1000
+
+static struct {
+  int events;
+  s64 total;
+} unijoy_bench;
+
+/* Joystick device */
+
+#define UNIJOY_JS_BUFFER_SIZE 64
+#define UNIJOY_JS_MAX_BUTTONS 255
+
+struct unijoy_js_client {
+  struct list_head node;
+  spinlock_t buffer_lock;
+  struct js_event buffer[UNIJOY_JS_BUFFER_SIZE];
+  int head;
+  int tail;
+  int startup;
+};
+
+static struct {
+  int minor;
+  bool exist;
+  int clients;
+  struct device dev;
+  struct cdev cdev;
+  spinlock_t client_lock;
+  struct list_head client_list;
+  wait_queue_head_t wait;
+} unijoy_js;
+
+static int unijoy_js_setup(void);
+static void unijoy_js_free(void);
+static void unijoy_js_free_device(struct device *);
+static void unijoy_js_report(int, int, int);
+static int unijoy_js_buttons(void);
+static int unijoy_js_startup_total(void);
+static bool unijoy_js_pending(struct unijoy_js_client *);
+static bool unijoy_js_next(struct unijoy_js_client *, struct js_event *);
+static int unijoy_js_open(struct inode *, struct file *);
+static int unijoy_js_release(struct inode *, struct file *);
+static ssize_t unijoy_js_read(struct file *, char __user *, size_t, loff_t *);
+static unsigned int unijoy_js_poll(struct file *, poll_table *);
+static long unijoy_js_ioctl(struct file *, unsigned int, unsigned long);
+#ifdef CONFIG_COMPAT
+static long unijoy_js_compat_ioctl(struct file *, unsigned int,
+                                   unsigned long);
+#endif
+
+static const struct file_operations unijoy_js_fops = {
+  .owner          = THIS_MODULE,
+  .read           = unijoy_js_read,
+  .poll           = unijoy_js_poll,
+  .open           = unijoy_js_open,
+  .release        = unijoy_js_release,
+  .unlocked_ioctl = unijoy_js_ioctl,
+#ifdef CONFIG_COMPAT
+  .compat_ioctl   = unijoy_js_compat_ioctl,
+#endif
+  .llseek         = no_llseek
+};
+
+/* Shared state */
+
+static struct unijoy_state *unijoy_state;
+
+static int unijoy_state_setup(void);
+static void unijoy_state_free(void);
+static void unijoy_state_update(int, int, int);
+static int unijoy_state_mmap(struct file *, struct vm_area_struct *);
+
+static const struct file_operations unijoy_state_fops = {
+  .owner  = THIS_MODULE,
+  .mmap   = unijoy_state_mmap,
+  .llseek = noop_llseek
+};
+
+static struct miscdevice unijoy_state_misc = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = "unijoy_state",
+  .fops  = &unijoy_state_fops,
+  .mode  = 0444
+};
+
+/* Memory accounting */
+
+static struct {
+  struct dentry *dir;
+  int sources;
+  int sources_peak;
+  int clients_peak;
+  size_t tap_peak;
+} unijoy_memory;
+
+static void unijoy_memory_setup(void);
+static void unijoy_memory_free(void);
+static int unijoy_memory_show(struct seq_file *, void *);
+static int unijoy_memory_open(struct inode *, struct file *);
+
+static const struct file_operations unijoy_memory_fops = {
+  .owner   = THIS_MODULE,
+  .open    = unijoy_memory_open,
+  .read    = seq_read,
+  .llseek  = seq_lseek,
+  .release = single_release
+};
+
+/* Event tap */
+
+#ifdef CONFIG_UNIJOY_TAP
+
+#define UNIJOY_TAP_HEADER_SIZE PAGE_ALIGN(sizeof(struct unijoy_tap_header))
+#define UNIJOY_TAP_SIZE \
+  (UNIJOY_TAP_HEADER_SIZE + \
+   PAGE_ALIGN(UNIJOY_TAP_RECORDS * sizeof(struct unijoy_tap_record)))
+
+static struct {
+  spinlock_t lock;
+  bool busy;
+  void *ring;
+  wait_queue_head_t wait;
+} unijoy_tap;
+
+static DEFINE_STATIC_KEY_FALSE(unijoy_tap_key);
+
+static int unijoy_tap_setup(void);
+static void unijoy_tap_free(void);
+static void unijoy_tap_record(struct unijoy_inph_source *,
+                              int, int, int, int, ktime_t);
+static int unijoy_tap_open(struct inode *, struct file *);
+static int unijoy_tap_release(struct inode *, struct file *);
+static int unijoy_tap_mmap(struct file *, struct vm_area_struct *);
+static unsigned int unijoy_tap_poll(struct file *, poll_table *);
+
+static const struct file_operations unijoy_tap_fops = {
+  .owner   = THIS_MODULE,
+  .open    = unijoy_tap_open,
+  .release = unijoy_tap_release,
+  .mmap    = unijoy_tap_mmap,
+  .poll    = unijoy_tap_poll,
+  .llseek  = noop_llseek
+};
+
+static struct miscdevice unijoy_tap_misc = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = "unijoy_tap",
+  .fops  = &unijoy_tap_fops,
+  .mode  = 0600
+};
+
+static inline void unijoy_tap_write(struct unijoy_inph_source *source,
+                                    int type, int code, int slot, int value,
+                                    ktime_t time) {
+  if (static_branch_unlikely(&unijoy_tap_key))
+    unijoy_tap_record(source, type, code, slot, value, time);
+}
+
+#else
+
+static inline int unijoy_tap_setup(void) { return 0; }
+static inline void unijoy_tap_free(void) { }
+static inline void unijoy_tap_write(struct unijoy_inph_source *source,
+                                    int type, int code, int slot, int value,
+                                    ktime_t time) { }
+
+#endif
+
 /* Sysfs Implementation */
 
 static int unijoy_sysfs_setup(void) {
@@ -277,6 +1132,10 @@ static ssize_t unijoy_sysfs_show(struct kobject *kobj, struct attribute *attr,
   int i;
   int offset = 0;
   struct unijoy_inph_source *source;
+
+  if (attr == &unijoy_sysfs_stats)
+    return unijoy_sysfs_show_stats(buf);
+
   spin_lock(&unijoy_sysfs.sources_lock);
   list_for_each_entry(source, &unijoy_sysfs.sources.list, list) {
     offset += scnprintf(buf+offset, PAGE_SIZE-offset,
@@ -286,6 +1145,14 @@ static ssize_t unijoy_sysfs_show(struct kobject *kobj, struct attribute *attr,
                         source->axis_total, source->buttons_total,
                         source->name);
   }
+  for (i = 0; i < unijoy_allowlist.ignored_total; i++) {
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        "%15llu %s %3d %3d %s\n",
+                        unijoy_allowlist.ignored[i].id, "     IGNORED",
+                        unijoy_allowlist.ignored[i].axis_total,
+                        unijoy_allowlist.ignored[i].buttons_total,
+                        unijoy_allowlist.ignored[i].name);
+  }
   offset += scnprintf(buf+offset, PAGE_SIZE-offset,
                       "Current mappings:\n");
   
@@ -315,6 +1182,152 @@ static ssize_t unijoy_sysfs_show(struct kobject *kobj, struct attribute *attr,
   return offset;
 }
 
+static ssize_t unijoy_sysfs_show_stats(char *buf) {
+  int i;
+  int offset = 0;
+  struct unijoy_inph_source *source;
+#ifdef CONFIG_UNIJOY_STATS
+  struct unijoy_thread_lane_stats *lane;
+#endif
+
+  offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                      "js_device %s js_clients %d\n",
+                      unijoy_js_device ? dev_name(&unijoy_js.dev) : "none",
+                      unijoy_js.clients);
+  offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                      "worker %s idles %u resumes %u\n",
+                      output.idle ? "idle" : "active",
+                      output.idles, output.resumes);
+  offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                      "health %s stalls %u stall_max_ms %lld direct %llu\n",
+                      unijoy_watchdog_health_names[unijoy_watchdog.health],
+                      unijoy_watchdog.stalls,
+                      div_s64(unijoy_watchdog.stall_max, NSEC_PER_MSEC),
+                      unijoy_watchdog.direct);
+#ifdef CONFIG_UNIJOY_STATS
+  for (i = 0; i < UNIJOY_LANE_CNT; i++) {
+    lane = &output.lanes[i];
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        "lane %s depth %d depth_max %d dropped %llu "
+                        "latency_avg_us %llu latency_max_us %llu\n",
+                        unijoy_thread_lane_names[i],
+                        i == UNIJOY_LANE_AXIS ? output.axis_pending_count :
+                          (output.full ? UNIJOY_BUFFER_SIZE :
+                            (output.head - output.tail) &
+                              (UNIJOY_BUFFER_SIZE - 1)),
+                        lane->depth_max, lane->dropped,
+                        lane->latency_count ?
+                          div64_u64(lane->latency_total,
+                                    lane->latency_count * NSEC_PER_USEC) : 0,
+                        div64_u64(lane->latency_max, NSEC_PER_USEC));
+  }
+  offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                      "refresh count %llu skipped %llu "
+                      "unregister_avg_us %llu unregister_max_us %llu "
+                      "register_avg_us %llu register_max_us %llu\n",
+                      output.refresh.count, output.refresh.skipped,
+                      output.refresh.count ?
+                        div64_u64(output.refresh.unregister_total,
+                                  output.refresh.count * NSEC_PER_USEC) : 0,
+                      div64_u64(output.refresh.unregister_max, NSEC_PER_USEC),
+                      output.refresh.count ?
+                        div64_u64(output.refresh.register_total,
+                                  output.refresh.count * NSEC_PER_USEC) : 0,
+                      div64_u64(output.refresh.register_max, NSEC_PER_USEC));
+#endif
+  if (unijoy_bench.events)
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        "bench events %d ns_per_event %lld\n",
+                        unijoy_bench.events,
+                        div_s64(unijoy_bench.total, unijoy_bench.events));
+
+  for (i = 0; i < ABS_CNT; i++) {
+    if (i < output.axis_total && output.source_axis_map[i].ranged)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "axis %d range %d %d %d\n",
+                          i, output.source_axis_map[i].range_min,
+                          output.source_axis_map[i].range_max,
+                          output.source_axis_map[i].invert);
+    if (output.trims[i].enabled)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "axis %d trim %llu %d %d %d %d %d\n",
+                          i, output.trims[i].id, output.trims[i].up,
+                          output.trims[i].down, output.trims[i].center,
+                          output.trims[i].step, output.trims[i].offset);
+    if (output.filters[i].type != UNIJOY_FILTER_NONE)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "axis %d filter %d %d %d\n",
+                          i, output.filters[i].type, output.filters[i].shift,
+                          output.filters[i].beta);
+    if (output.motions[i].rate)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "axis %d motion %d %d %d\n",
+                          i, output.motions[i].rate,
+                          output.motions[i].integrate,
+                          output.motions[i].shift);
+  }
+
+  for (i = 0; i < UNIJOY_MAX_PROGRAMS; i++) {
+    if (output.programs[i].active)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "%s %d program %d last %d\n",
+                          output.programs[i].button ? "button" : "axis",
+                          output.programs[i].number,
+                          output.programs[i].length,
+                          output.programs[i].last);
+  }
+
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    if (output.shares[i].policy != UNIJOY_SHARE_NONE)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "%s %d share %d %d inputs %d owner %d last %d\n",
+                          output.shares[i].button ? "button" : "axis",
+                          output.shares[i].number, output.shares[i].policy,
+                          output.shares[i].param,
+                          output.shares[i].extras + 1,
+                          output.shares[i].owner, output.shares[i].last);
+  }
+
+  for (i = 0; i < UNIJOY_MAX_BUTTONS; i++) {
+    if (output.behaviours[i].type != UNIJOY_BEHAVIOUR_NONE)
+      offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                          "button %d behaviour %d %d %d %d\n",
+                          i, output.behaviours[i].type,
+                          output.behaviours[i].params[0],
+                          output.behaviours[i].params[1],
+                          output.behaviours[i].params[2]);
+  }
+
+  spin_lock(&unijoy_sysfs.sources_lock);
+  list_for_each_entry(source, &unijoy_sysfs.sources.list, list) {
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        "%15llu policy %d opened %d exclusive %d grabbed %d "
+                        "reconnects %u",
+                        source->id, source->policy, source->opened,
+                        source->exclusive, source->grabbed,
+                        source->reconnects);
+#ifdef CONFIG_UNIJOY_STATS
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        " reconnect_latency_us %lld",
+                        div_s64(source->reconnect_latency, NSEC_PER_USEC));
+#endif
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset, "\n");
+#ifdef CONFIG_UNIJOY_STATS
+    offset += scnprintf(buf+offset, PAGE_SIZE-offset,
+                        "%15llu frames %llu rate_hz %lld jitter_us %lld "
+                        "interval_max_us %lld gaps %u\n",
+                        source->id, source->frames,
+                        source->interval_avg ?
+                          div64_s64(NSEC_PER_SEC, source->interval_avg) : 0,
+                        div_s64(source->interval_dev, NSEC_PER_USEC),
+                        div_s64(source->interval_max, NSEC_PER_USEC),
+                        source->gaps);
+#endif
+  }
+  spin_unlock(&unijoy_sysfs.sources_lock);
+  return offset;
+}
+
 static ssize_t unijoy_sysfs_store(struct kobject *kobj, struct attribute *attr,
                                   const char *in_buf, size_t in_len) {
   struct unijoy_inph_source *source;
@@ -325,7 +1338,8 @@ static ssize_t unijoy_sysfs_store(struct kobject *kobj, struct attribute *attr,
   int op = 0;
   int len = in_len;
   __u64 id = ULLONG_MAX;
-  int arg1 = -1, arg2 = -1;
+  int arg1 = -1, arg2 = -1, arg3 = -1, arg4 = -1, arg5 = -1;
+  int args;
 
   if (!buf) 
     return in_len;
@@ -355,12 +1369,22 @@ static ssize_t unijoy_sysfs_store(struct kobject *kobj, struct attribute *attr,
   OPWORDTEST("del_button", 4);
   OPWORDTEST("add_axis", 5);
   OPWORDTEST("del_axis", 6);
+  OPWORDTEST("policy", 7);
+  OPWORDTEST("exclusive", 8);
+  OPWORDTEST("filter", 9);
+  OPWORDTEST("range", 10);
+  OPWORDTEST("behaviour", 11);
+  OPWORDTEST("trim", 12);
+  OPWORDTEST("program", 13);
+  OPWORDTEST("bench", 14);
+  OPWORDTEST("share", 15);
+  OPWORDTEST("motion", 16);
 
   if (len == 0 || op == 0) error = 1;
 
   if (!error) {
     for (rptr = ptr; 
-         *rptr && (isspace(*rptr) || isdigit(*rptr)) && len; 
+         *rptr && (isspace(*rptr) || isdigit(*rptr) || *rptr == '-') && len; 
          rptr++, len--);
   
     error = rptr != (buf+in_len);
@@ -400,6 +1424,50 @@ static ssize_t unijoy_sysfs_store(struct kobject *kobj, struct attribute *attr,
       sscanf(ptr, "%d", &arg1);
       unijoy_sysfs_del_axis(arg1);
       break;
+    case 7:
+      sscanf(ptr, "%llu %d", &id, &arg1);
+      source = unijoy_sysfs_find(id);
+      unijoy_sysfs_policy(source, arg1);
+      break;
+    case 8:
+      sscanf(ptr, "%llu %d", &id, &arg1);
+      source = unijoy_sysfs_find(id);
+      unijoy_sysfs_exclusive(source, arg1);
+      break;
+    case 9:
+      sscanf(ptr, "%d %d %d %d", &arg1, &arg2, &arg3, &arg4);
+      unijoy_sysfs_filter(arg1, arg2, arg3, arg4);
+      break;
+    case 10:
+      args = sscanf(ptr, "%d %d %d %d", &arg1, &arg2, &arg3, &arg4);
+      unijoy_sysfs_range(arg1, arg2, arg3, arg4 > 0, args >= 3);
+      break;
+    case 11:
+      sscanf(ptr, "%d %d %d %d %d", &arg1, &arg2, &arg3, &arg4, &arg5);
+      unijoy_sysfs_behaviour(arg1, arg2, arg3, arg4, arg5);
+      break;
+    case 12:
+      sscanf(ptr, "%d %llu %d %d %d %d",
+             &arg1, &id, &arg2, &arg3, &arg4, &arg5);
+      source = unijoy_sysfs_find(id);
+      unijoy_sysfs_trim(arg1, source, arg2, arg3, arg4, arg5);
+      break;
+    case 13:
+      unijoy_sysfs_program(ptr);
+      break;
+    case 14:
+      sscanf(ptr, "%llu %d", &id, &arg1);
+      source = unijoy_sysfs_find(id);
+      unijoy_sysfs_bench(source, arg1);
+      break;
+    case 15:
+      sscanf(ptr, "%d %d %d %d", &arg1, &arg2, &arg3, &arg4);
+      unijoy_sysfs_share(arg1, arg2, arg3, arg4);
+      break;
+    case 16:
+      sscanf(ptr, "%d %d %d %d", &arg1, &arg2, &arg3, &arg4);
+      unijoy_sysfs_motion(arg1, arg2, arg3 > 0, arg4);
+      break;
   }
 
   kfree(buf);
@@ -430,11 +1498,12 @@ static struct unijoy_inph_source *unijoy_sysfs_find(__u64 id) {
   static void unijoy_sysfs_add_ ## single (struct unijoy_inph_source *source, \
                                            int src_no, int dst_no) { \
     int i; \
+    struct unijoy_inph_source *prev; \
     if (!source) \
       return; \
     if (source->state != UNIJOY_SOURCE_MERGED) \
       return; \
-    if (src_no < 0 || src_no > source-> name ## _total) \
+    if (src_no < 0 || src_no >= source-> name ## _total) \
       return; \
     if (dst_no < 0) { \
       for (i = 0; i < output. name ## _total ; i++) { \
@@ -447,27 +1516,42 @@ static struct unijoy_inph_source *unijoy_sysfs_find(__u64 id) {
         dst_no = output. name ## _total; \
       } \
     } \
-    if (dst_no >= output. name ## _total) { \
-      if (dst_no >= MAX_VALUE) \
-        return; \
-      output. name ## _total = dst_no + 1; \
+    if (dst_no < 0 || dst_no >= MAX_VALUE) \
+      return; \
+    if (output.source_ ## name ## _map[dst_no].share && \
+        output.source_ ## name ## _map[dst_no].id != ULLONG_MAX) { \
+      unijoy_sysfs_join(&output.shares[ \
+                          output.source_ ## name ## _map[dst_no].share - 1], \
+                        source, src_no); \
+      return; \
     } \
+    if (dst_no >= output. name ## _total) \
+      output. name ## _total = dst_no + 1; \
+    prev = output.source_ ## name ## _map[dst_no].source; \
     output.source_ ## name ## _map[dst_no].source = source; \
     output.source_ ## name ## _map[dst_no].value  = src_no; \
     output.source_ ## name ## _map[dst_no].id     = source->id; \
+    output.source_ ## name ## _map[dst_no].ranged = false; \
+    unijoy_inph_select_ ## single (dst_no); \
+    unijoy_sysfs_update(source); \
+    if (prev != source) \
+      unijoy_sysfs_update(prev); \
     unijoy_inph_refresh(); \
   }
 
 UNIJOY_ADD_RESOURCE(button, buttons, UNIJOY_MAX_BUTTONS);
 UNIJOY_ADD_RESOURCE(axis, axis, ABS_CNT);
 
-#define UNIJOY_DEL_RESOURCE(single, name) \
+#define UNIJOY_DEL_RESOURCE(single, name, action) \
   static void unijoy_sysfs_del_ ## single (int dst_no) { \
     int i; \
+    struct unijoy_inph_source *prev; \
     if (dst_no < 0 || dst_no >= output. name ## _total) \
       return; \
     if (output.source_ ## name ##_map[dst_no].id == ULLONG_MAX) \
       return; \
+    unijoy_sysfs_leave(&output.source_ ## name ## _map[dst_no]); \
+    prev = output.source_ ## name ## _map[dst_no].source; \
     output.source_ ## name ## _map[dst_no].source = 0; \
     output.source_ ## name ## _map[dst_no].id     = ULLONG_MAX; \
     if (dst_no+1 == output. name ## _total) { \
@@ -476,11 +1560,13 @@ UNIJOY_ADD_RESOURCE(axis, axis, ABS_CNT);
         i--; \
       output. name ## _total = i+1; \
     } \
+    unijoy_sysfs_update(prev); \
+    unijoy_inph_release(action, dst_no); \
     unijoy_inph_refresh(); \
   }
 
-UNIJOY_DEL_RESOURCE(button, buttons);
-UNIJOY_DEL_RESOURCE(axis, axis);
+UNIJOY_DEL_RESOURCE(button, buttons, UNIJOY_ACTION_REPORT_BUTTON);
+UNIJOY_DEL_RESOURCE(axis, axis, UNIJOY_ACTION_REPORT_AXIS);
 
 static void unijoy_sysfs_merge(struct unijoy_inph_source *source) {
   if (!source)
@@ -489,15 +1575,15 @@ static void unijoy_sysfs_merge(struct unijoy_inph_source *source) {
   if (source->state == UNIJOY_SOURCE_MERGED)
     return;
 
-  input_open_device(&source->handle);
-
   source->state = UNIJOY_SOURCE_MERGED;
+  unijoy_sysfs_update(source);
   unijoy_inph_refresh();
 }
 
 static void unijoy_sysfs_clean(struct unijoy_inph_source *source,
                                bool forever) {
-  int i;
+  struct unijoy_inph_share *share;
+  int i, j;
   
   if (!source)
     return;
@@ -518,6 +1604,34 @@ static void unijoy_sysfs_clean(struct unijoy_inph_source *source,
   } while (0) 
   CLEAN_RESOURCE(buttons);
   CLEAN_RESOURCE(axis);
+
+  for (i = 0; i < ABS_CNT; i++) {
+    if (output.trims[i].enabled && output.trims[i].id == source->id) {
+      output.trims[i].source = 0;
+      if (forever)
+        output.trims[i].enabled = false;
+    }
+  }
+
+  spin_lock_irq(&output.share_lock);
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    share = &output.shares[i];
+    for (j = 0; j < share->extras; j++) {
+      if (share->extra[j].id != source->id)
+        continue;
+      share->extra[j].source = 0;
+      if (!forever)
+        continue;
+      share->extras--;
+      memmove(&share->extra[j], &share->extra[j + 1],
+              (share->extras - j) * sizeof(struct unijoy_inph_input));
+      memmove(&share->values[j + 1], &share->values[j + 2],
+              (share->extras - j) * sizeof(int));
+      share->owner = 0;
+      j--;
+    }
+  }
+  spin_unlock_irq(&output.share_lock);
 }
 
 static void unijoy_sysfs_unmerge(struct unijoy_inph_source *source) {
@@ -532,10 +1646,10 @@ static void unijoy_sysfs_unmerge(struct unijoy_inph_source *source) {
   if (source->state != UNIJOY_SOURCE_MERGED)
     return;
   
-  input_close_device(&source->handle);
+  source->state = UNIJOY_SOURCE_ONLINE;
   unijoy_sysfs_clean(source, true);
+  unijoy_sysfs_update(source);
   unijoy_inph_refresh();
-  source->state = UNIJOY_SOURCE_ONLINE;
 }
 
 static void unijoy_sysfs_remove(struct unijoy_inph_source *source) {
@@ -547,368 +1661,2942 @@ static void unijoy_sysfs_remove(struct unijoy_inph_source *source) {
   
   spin_lock(&unijoy_sysfs.sources_lock);
   list_del(&source->list);
+  unijoy_memory.sources--;
   spin_unlock(&unijoy_sysfs.sources_lock);
   
   kfree(source);
 }
 
+/*
+ * Shared destinations are released only as far as their other inputs
+ * let them.
+ */
+static void unijoy_sysfs_neutralize(struct unijoy_inph_source *source) {
+  struct unijoy_inph_map *map;
+  struct unijoy_inph_share *share;
+  int i, j, value;
+  bool dirty = false;
+  ktime_t now = ktime_get();
+
+  for (i = 0; i < output.buttons_total; i++) {
+    map = &output.source_buttons_map[i];
+    if (map->source != source)
+      continue;
+    value = 0;
+    if (map->share &&
+        !unijoy_inph_resolve(&output.shares[map->share - 1], 0, &value, now))
+      continue;
+    if (!value)
+      unijoy_inph_behaviour_stop(i);
+    unijoy_inph_enqueue(UNIJOY_ACTION_REPORT_BUTTON, i, value, now);
+    unijoy_inph_report(JS_EVENT_BUTTON, i, value);
+    dirty = true;
+  }
+
+  if (source->policy == UNIJOY_POLICY_CENTER) {
+    for (i = 0; i < output.axis_total; i++) {
+      map = &output.source_axis_map[i];
+      if (map->source != source)
+        continue;
+      value = 0;
+      if (map->share &&
+          !unijoy_inph_resolve(&output.shares[map->share - 1], 0, &value,
+                               now))
+        continue;
+      unijoy_inph_cancel_axis(i);
+      unijoy_inph_enqueue(UNIJOY_ACTION_REPORT_AXIS, i, value, now);
+      unijoy_inph_report(JS_EVENT_AXIS, i, value);
+      dirty = true;
+    }
+  }
+
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    share = &output.shares[i];
+    if (share->policy == UNIJOY_SHARE_NONE)
+      continue;
+    if (!share->button && source->policy != UNIJOY_POLICY_CENTER)
+      continue;
+    for (j = 0; j < share->extras; j++) {
+      value = 0;
+      if (share->extra[j].source != source ||
+          !unijoy_inph_resolve(share, j + 1, &value, now))
+        continue;
+      if (share->button) {
+        unijoy_inph_enqueue(UNIJOY_ACTION_REPORT_BUTTON, share->number,
+                            value, now);
+        unijoy_inph_report(JS_EVENT_BUTTON, share->number, value);
+      } else {
+        unijoy_inph_cancel_axis(share->number);
+        unijoy_inph_enqueue(UNIJOY_ACTION_REPORT_AXIS, share->number,
+                            value, now);
+        unijoy_inph_report(JS_EVENT_AXIS, share->number, value);
+      }
+      dirty = true;
+    }
+  }
+
+  if (dirty)
+    unijoy_inph_enqueue(UNIJOY_ACTION_SYNC, 0, 0, now);
+}
+
+/*
+ * Capabilities of virtual device do not depend on presence of sources
+ * (mapping ids are kept), so hotplug only neutralizes and relinks
+ * destinations instead of re-registering virtual device.
+ */
 static void unijoy_sysfs_suspend(struct unijoy_inph_source *source) {
   if (!source)
     return;
 
+  unijoy_sysfs_neutralize(source);
   unijoy_sysfs_clean(source, false);
-  unijoy_inph_refresh();
   source->state = UNIJOY_SOURCE_DISCONNECTED;
+  unijoy_sysfs_update(source);
 }
 
-/* Input handlers implementation */
+static void unijoy_sysfs_resume(struct unijoy_inph_source *source) {
+  if (!source)
+    return;
 
-static bool unijoy_inph_match(struct input_handler *handler, 
-                              struct input_dev *dev) {
-  if (test_bit(EV_KEY, dev->evbit) && test_bit(BTN_TOUCH, dev->keybit))
-    return false;
+  if (source->state != UNIJOY_SOURCE_DISCONNECTED)
+    return;
+
+  unijoy_inph_relink(source, source->id);
+  source->reconnects++;
+  source->resumed_at = ktime_to_ns(ktime_get());
+  source->frame_at = 0;
+  source->state = UNIJOY_SOURCE_MERGED;
+  unijoy_sysfs_update(source);
+}
+
+static void unijoy_sysfs_policy(struct unijoy_inph_source *source,
+                                int policy) {
+  if (!source)
+    return;
+
+  if (policy != UNIJOY_POLICY_CENTER && policy != UNIJOY_POLICY_HOLD)
+    return;
+
+  source->policy = policy;
+}
+
+/*
+ * Brings grab of source in line with its exclusive flag: only opened
+ * devices are ever grabbed.
+ */
+static void unijoy_sysfs_grab(struct unijoy_inph_source *source) {
+  bool wanted = source->exclusive && source->opened;
+
+  if (wanted == source->grabbed)
+    return;
+
+  if (wanted) {
+    source->grabbed = !input_grab_device(&source->handle);
+  } else {
+    input_release_device(&source->handle);
+    source->grabbed = false;
+  }
+}
+
+/*
+ * Rebuilds bitmaps of mapped codes of source and keeps its handle opened
+ * only while at least one destination references it, so unmapped devices
+ * are not polled at all.
+ */
+static void unijoy_sysfs_update(struct unijoy_inph_source *source) {
+  DECLARE_BITMAP(keys, KEY_CNT);
+  DECLARE_BITMAP(abs, ABS_CNT);
+  struct unijoy_inph_share *share;
+  bool wanted;
+  int i, j;
+
+  if (!source)
+    return;
+
+  bitmap_zero(keys, KEY_CNT);
+  bitmap_zero(abs, ABS_CNT);
+
+  for (i = 0; i < output.buttons_total; i++) {
+    if (output.source_buttons_map[i].source == source)
+      __set_bit(source->button_revmap[output.source_buttons_map[i].value],
+                keys);
+  }
+  for (i = 0; i < output.axis_total; i++) {
+    if (output.source_axis_map[i].source == source)
+      __set_bit(source->axis_revmap[output.source_axis_map[i].value], abs);
+  }
+
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    share = &output.shares[i];
+    if (share->policy == UNIJOY_SHARE_NONE)
+      continue;
+    for (j = 0; j < share->extras; j++) {
+      if (share->extra[j].source != source)
+        continue;
+      if (share->button)
+        __set_bit(source->button_revmap[share->extra[j].value], keys);
+      else
+        __set_bit(source->axis_revmap[share->extra[j].value], abs);
+    }
+  }
+
+  source->trimming = false;
+  for (i = 0; i < ABS_CNT; i++) {
+    if (!output.trims[i].enabled || output.trims[i].source != source)
+      continue;
+    __set_bit(source->button_revmap[output.trims[i].up], keys);
+    __set_bit(source->button_revmap[output.trims[i].down], keys);
+    if (output.trims[i].center >= 0)
+      __set_bit(source->button_revmap[output.trims[i].center], keys);
+    source->trimming = true;
+  }
+
+  bitmap_copy(source->mapped_keys, keys, KEY_CNT);
+  bitmap_copy(source->mapped_abs, abs, ABS_CNT);
+
+  wanted = source->state == UNIJOY_SOURCE_MERGED &&
+           (!bitmap_empty(keys, KEY_CNT) || !bitmap_empty(abs, ABS_CNT));
+
+  if (wanted && !source->opened) {
+    source->frame_at = 0;
+    source->opened = !input_open_device(&source->handle);
+  } else if (!wanted && source->opened) {
+    if (source->grabbed) {
+      input_release_device(&source->handle);
+      source->grabbed = false;
+    }
+    input_close_device(&source->handle);
+    source->opened = false;
+  }
+
+  unijoy_sysfs_grab(source);
+}
+
+static void unijoy_sysfs_exclusive(struct unijoy_inph_source *source,
+                                   int exclusive) {
+  if (!source)
+    return;
+
+  source->exclusive = exclusive != 0;
+  unijoy_sysfs_grab(source);
+}
+
+/*
+ * Window is precomputed into 16.16 fixed point scale and offset, so
+ * event path spends a single multiply-add per destination on it.
+ */
+static void unijoy_sysfs_range(int dst_no, int in_min, int in_max,
+                               bool invert, bool enable) {
+  struct unijoy_inph_map *map;
+  __s64 scale;
+
+  if (dst_no < 0 || dst_no >= output.axis_total)
+    return;
+
+  map = &output.source_axis_map[dst_no];
+
+  if (!enable) {
+    map->ranged = false;
+    unijoy_inph_select_axis(dst_no);
+    return;
+  }
+
+  if (in_min < SHRT_MIN || in_max > SHRT_MAX || in_min >= in_max)
+    return;
+
+  scale = div_s64((__s64)(SHRT_MAX - SHRT_MIN) << UNIJOY_RANGE_FRACTION,
+                  in_max - in_min);
+
+  map->ranged = false;
+  smp_wmb();
+
+  map->range_min = in_min;
+  map->range_max = in_max;
+  map->invert = invert;
+  if (invert) {
+    map->scale = -scale;
+    map->offset = (__s64)SHRT_MAX * (1 << UNIJOY_RANGE_FRACTION) +
+                  in_min * scale;
+  } else {
+    map->scale = scale;
+    map->offset = (__s64)SHRT_MIN * (1 << UNIJOY_RANGE_FRACTION) -
+                  in_min * scale;
+  }
+
+  smp_wmb();
+  map->ranged = true;
+  unijoy_inph_select_axis(dst_no);
+}
+
+static void unijoy_sysfs_motion(int dst_no, int rate, int integrate,
+                                int shift) {
+  struct unijoy_inph_motion *motion;
+
+  if (dst_no < 0 || dst_no >= ABS_CNT)
+    return;
+
+  if (rate < 0 || rate > UNIJOY_MOTION_MAX_RATE)
+    return;
+
+  if (shift < 0)
+    shift = UNIJOY_MOTION_SHIFT;
+
+  if (shift > UNIJOY_MOTION_MAX_SHIFT)
+    return;
+
+  motion = &output.motions[dst_no];
+
+  motion->rate = 0;
+  smp_wmb();
+
+  motion->integrate = integrate;
+  motion->shift = shift;
+  motion->period = rate ? NSEC_PER_SEC / rate : 0;
+  motion->emitted = 0;
+  motion->sampled = 0;
+  motion->sum = 0;
+  motion->count = 0;
+  motion->angle = 0;
+
+  smp_wmb();
+  motion->rate = rate;
+  unijoy_sysfs_keys();
+}
+
+static void unijoy_sysfs_filter(int dst_no, int type, int param1, int param2) {
+  struct unijoy_inph_filter *filter;
+
+  if (dst_no < 0 || dst_no >= ABS_CNT)
+    return;
+
+  filter = &output.filters[dst_no];
+
+  switch (type) {
+    case UNIJOY_FILTER_NONE:
+      break;
+    case UNIJOY_FILTER_EMA:
+      if (param1 < 1 || param1 > UNIJOY_FILTER_MAX_SHIFT)
+        return;
+      break;
+    case UNIJOY_FILTER_MEDIAN:
+      if (param1 != 3 && param1 != 5)
+        return;
+      break;
+    case UNIJOY_FILTER_ADAPTIVE:
+      if (param1 < 1 || param1 > UNIJOY_FILTER_MAX_SHIFT)
+        return;
+      if (param2 < 0)
+        param2 = 0;
+      if (param2 > 15)
+        return;
+      break;
+    default:
+      return;
+  }
+
+  filter->type = UNIJOY_FILTER_NONE;
+  smp_wmb();
+
+  filter->shift = param1;
+  filter->window = param1;
+  filter->beta = param2;
+  filter->pos = 0;
+  filter->primed = false;
+
+  smp_wmb();
+  filter->type = type;
+  unijoy_inph_select_axis(dst_no);
+}
+
+static void unijoy_sysfs_behaviour(int dst_no, int type, int param1,
+                                   int param2, int param3) {
+  struct unijoy_inph_behaviour *behaviour;
+  unsigned long flags;
+  bool state;
+
+  if (dst_no < 0 || dst_no >= UNIJOY_MAX_BUTTONS)
+    return;
+
+  switch (type) {
+    case UNIJOY_BEHAVIOUR_NONE:
+    case UNIJOY_BEHAVIOUR_TOGGLE:
+      break;
+    case UNIJOY_BEHAVIOUR_PULSE:
+      if (param1 < 1 || param1 > UNIJOY_BEHAVIOUR_MAX_MS)
+        return;
+      break;
+    case UNIJOY_BEHAVIOUR_TURBO:
+      if (param1 < 1 || param1 > UNIJOY_BEHAVIOUR_MAX_HZ)
+        return;
+      break;
+    case UNIJOY_BEHAVIOUR_SEQUENCE:
+      if (param1 < 1 || param1 > UNIJOY_BEHAVIOUR_MAX_MS ||
+          param2 < 1 || param2 > UNIJOY_BEHAVIOUR_MAX_MS ||
+          param3 < 1 || param3 > UNIJOY_BEHAVIOUR_MAX_COUNT)
+        return;
+      break;
+    default:
+      return;
+  }
+
+  behaviour = &output.behaviours[dst_no];
+
+  spin_lock_irqsave(&output.behaviour_lock, flags);
+  behaviour->type = UNIJOY_BEHAVIOUR_NONE;
+  state = behaviour->state;
+  spin_unlock_irqrestore(&output.behaviour_lock, flags);
+
+  hrtimer_cancel(&behaviour->timer);
+  unijoy_inph_behaviour_stop(dst_no);
+  if (state)
+    unijoy_inph_behaviour_emit(behaviour, 0, ktime_get());
+
+  spin_lock_irqsave(&output.behaviour_lock, flags);
+  behaviour->params[0] = param1;
+  behaviour->params[1] = param2;
+  behaviour->params[2] = param3;
+  if (type == UNIJOY_BEHAVIOUR_TURBO) {
+    behaviour->on = ns_to_ktime(NSEC_PER_SEC / (2 * param1));
+    behaviour->off = behaviour->on;
+  } else {
+    behaviour->on = ns_to_ktime((u64)param1 * NSEC_PER_MSEC);
+    behaviour->off = ns_to_ktime((u64)param2 * NSEC_PER_MSEC);
+  }
+  behaviour->type = type;
+  spin_unlock_irqrestore(&output.behaviour_lock, flags);
+  unijoy_inph_select_button(dst_no);
+}
+
+static void unijoy_sysfs_trim(int dst_no, struct unijoy_inph_source *source,
+                              int up, int down, int center, int step) {
+  struct unijoy_inph_trim *trim;
+  struct unijoy_inph_source *prev;
+
+  if (dst_no < 0 || dst_no >= ABS_CNT)
+    return;
+
+  trim = &output.trims[dst_no];
+  prev = trim->source;
+
+  if (!source) {
+    if (!trim->enabled)
+      return;
+    trim->enabled = false;
+    trim->source = 0;
+    unijoy_inph_select_axis(dst_no);
+    unijoy_sysfs_update(prev);
+    unijoy_sysfs_keys();
+
+    /*
+     * Filter state belongs to dispatch, so untrimmed value is queued
+     * as is, the next source event runs it through all the stages.
+     */
+    unijoy_inph_enqueue_axis(dst_no, trim->base, ktime_get());
+    unijoy_inph_report(JS_EVENT_AXIS, dst_no, trim->base);
+    return;
+  }
+
+  if (source->state != UNIJOY_SOURCE_MERGED)
+    return;
+
+  if (up < 0 || up >= source->buttons_total ||
+      down < 0 || down >= source->buttons_total ||
+      center >= source->buttons_total)
+    return;
+
+  if (step < 0)
+    step = UNIJOY_TRIM_STEP;
+
+  if (step < 1 || step > UNIJOY_TRIM_MAX_STEP)
+    return;
+
+  trim->source = source;
+  trim->id = source->id;
+  trim->up = up;
+  trim->down = down;
+  trim->center = center;
+  trim->step = step;
+  /*
+   * Base is seeded by the last value queued for destination, so a nudge
+   * before the source axis moves again does not snap it to center.
+   */
+  if (!trim->enabled) {
+    trim->offset = 0;
+    trim->base = READ_ONCE(output.axis_value[dst_no]);
+  }
+  trim->enabled = true;
+  unijoy_inph_select_axis(dst_no);
+  unijoy_sysfs_keys();
+
+  unijoy_sysfs_update(source);
+  if (prev != source)
+    unijoy_sysfs_update(prev);
+}
+
+static void unijoy_sysfs_program(char *ptr) {
+  struct unijoy_inph_insn code[UNIJOY_PROGRAM_MAX_INSNS];
+  struct unijoy_inph_program *program = 0;
+  struct unijoy_inph_map *map;
+  int button, dst_no, op, arg, len, i;
+  int length = 0;
+
+  if (sscanf(ptr, "%d %d%n", &button, &dst_no, &len) != 2)
+    return;
+  ptr += len;
+
+  while (sscanf(ptr, "%d %d%n", &op, &arg, &len) == 2) {
+    if (length == UNIJOY_PROGRAM_MAX_INSNS || op < 0 || op >= UNIJOY_OP_CNT)
+      return;
+    code[length].op = op;
+    code[length].arg = arg;
+    length++;
+    ptr += len;
+  }
+
+  if (button != 0 && button != 1)
+    return;
+
+  if (dst_no < 0 ||
+      dst_no >= (button ? UNIJOY_MAX_BUTTONS : ABS_CNT))
+    return;
+
+  if (length && !unijoy_sysfs_verify(code, length))
+    return;
+
+  map = button ? &output.source_buttons_map[dst_no] :
+                 &output.source_axis_map[dst_no];
+
+  spin_lock_irq(&output.program_lock);
+
+  if (map->program) {
+    program = &output.programs[map->program - 1];
+    program->active = false;
+    output.programs_active--;
+    map->program = 0;
+  }
+
+  if (!length)
+    goto unlock_exit;
+
+  for (i = 0; i < UNIJOY_MAX_PROGRAMS && !program; i++) {
+    if (!output.programs[i].active)
+      program = &output.programs[i];
+  }
+
+  if (!program)
+    goto unlock_exit;
+
+  program->button = button;
+  program->number = dst_no;
+  program->length = length;
+  program->input = 0;
+  program->last = INT_MIN;
+  memcpy(program->code, code, length * sizeof(struct unijoy_inph_insn));
+  program->active = true;
+  output.programs_active++;
+  map->program = program - output.programs + 1;
+
+unlock_exit:
+  spin_unlock_irq(&output.program_lock);
+  unijoy_sysfs_keys();
+}
+
+/*
+ * Changing policy of shared destination keeps its inputs, so they can
+ * be tried with different policies without re-adding them.
+ */
+static void unijoy_sysfs_share(int button, int dst_no, int policy,
+                               int param) {
+  struct unijoy_inph_share *share = 0;
+  struct unijoy_inph_map *map;
+  int i;
+
+  if (button != 0 && button != 1)
+    return;
+
+  if (dst_no < 0 ||
+      dst_no >= (button ? UNIJOY_MAX_BUTTONS : ABS_CNT))
+    return;
+
+  if (policy < UNIJOY_SHARE_NONE || policy >= UNIJOY_SHARE_CNT)
+    return;
+
+  if (policy == UNIJOY_SHARE_ANY && !button)
+    return;
+
+  if (param < 0)
+    param = 0;
+
+  if (policy == UNIJOY_SHARE_LATEST && param > UNIJOY_SHARE_MAX_HOLD_MS)
+    return;
+
+  if (policy == UNIJOY_SHARE_PRIORITY && param > SHRT_MAX)
+    return;
+
+  map = button ? &output.source_buttons_map[dst_no] :
+                 &output.source_axis_map[dst_no];
+
+  if (policy == UNIJOY_SHARE_NONE) {
+    if (!map->share)
+      return;
+    unijoy_sysfs_leave(map);
+    spin_lock_irq(&output.share_lock);
+    output.shares[map->share - 1].policy = UNIJOY_SHARE_NONE;
+    output.shares_active--;
+    map->share = 0;
+    spin_unlock_irq(&output.share_lock);
+    unijoy_sysfs_keys();
+    return;
+  }
+
+  if (map->share)
+    share = &output.shares[map->share - 1];
+
+  for (i = 0; i < UNIJOY_MAX_SHARES && !share; i++) {
+    if (output.shares[i].policy == UNIJOY_SHARE_NONE) {
+      share = &output.shares[i];
+      memset(share, 0, sizeof(struct unijoy_inph_share));
+      share->last = INT_MIN;
+    }
+  }
+
+  if (!share)
+    return;
+
+  spin_lock_irq(&output.share_lock);
+  share->button = button;
+  share->number = dst_no;
+  share->param = param;
+  share->hold = (s64)param * NSEC_PER_MSEC;
+  if (share->policy == UNIJOY_SHARE_NONE)
+    output.shares_active++;
+  share->policy = policy;
+  map->share = share - output.shares + 1;
+  spin_unlock_irq(&output.share_lock);
+  unijoy_sysfs_keys();
+}
+
+static void unijoy_sysfs_join(struct unijoy_inph_share *share,
+                              struct unijoy_inph_source *source,
+                              int src_no) {
+  struct unijoy_inph_input *input;
+
+  if (share->extras == UNIJOY_SHARE_MAX_INPUTS - 1)
+    return;
+
+  spin_lock_irq(&output.share_lock);
+  input = &share->extra[share->extras];
+  input->source = source;
+  input->id = source->id;
+  input->value = src_no;
+  share->values[share->extras + 1] = 0;
+  share->extras++;
+  spin_unlock_irq(&output.share_lock);
+
+  unijoy_sysfs_update(source);
+}
+
+/* Drops joined inputs of destination, its own mapping is left as is. */
+static void unijoy_sysfs_leave(struct unijoy_inph_map *map) {
+  struct unijoy_inph_input extra[UNIJOY_SHARE_MAX_INPUTS - 1];
+  struct unijoy_inph_share *share;
+  int i, extras;
+
+  if (!map->share)
+    return;
+
+  share = &output.shares[map->share - 1];
+
+  spin_lock_irq(&output.share_lock);
+  extras = share->extras;
+  memcpy(extra, share->extra, sizeof(extra));
+  share->extras = 0;
+  share->owner = 0;
+  spin_unlock_irq(&output.share_lock);
+
+  for (i = 0; i < extras; i++)
+    unijoy_sysfs_update(extra[i].source);
+}
+
+/*
+ * Static keys are flipped from here only, process context is required
+ * to patch them.
+ */
+static void unijoy_sysfs_keys(void) {
+  int i;
+
+  for (i = 0; i < ABS_CNT && !output.trims[i].enabled; i++);
+
+  if (i < ABS_CNT)
+    static_branch_enable(&unijoy_trim_key);
+  else
+    static_branch_disable(&unijoy_trim_key);
+
+  if (output.programs_active)
+    static_branch_enable(&unijoy_program_key);
+  else
+    static_branch_disable(&unijoy_program_key);
+
+  if (output.shares_active)
+    static_branch_enable(&unijoy_share_key);
+  else
+    static_branch_disable(&unijoy_share_key);
+
+  for (i = 0; i < ABS_CNT && !output.motions[i].rate; i++);
+
+  if (i < ABS_CNT)
+    static_branch_enable(&unijoy_motion_key);
+  else
+    static_branch_disable(&unijoy_motion_key);
+}
+
+/*
+ * Events are fed in batches with interrupts disabled and under RCU read
+ * lock, the same way input core calls handlers. Axes get their current
+ * value back after the run.
+ */
+static void unijoy_sysfs_bench(struct unijoy_inph_source *source,
+                               int count) {
+  struct input_dev *dev;
+  unsigned int type = EV_ABS;
+  unsigned int code;
+  unsigned long flags;
+  ktime_t start;
+  s64 total = 0;
+  int i, j, n, value;
+
+  if (!source || !source->opened)
+    return;
+
+  if (count < 2 || count > UNIJOY_BENCH_MAX)
+    return;
+
+  count &= ~1;
+  dev = source->handle.dev;
+
+  code = find_first_bit(source->mapped_abs, ABS_CNT);
+  if (code == ABS_CNT) {
+    type = EV_KEY;
+    code = find_first_bit(source->mapped_keys, KEY_CNT);
+  }
+
+  value = type == EV_ABS ? input_abs_get_val(dev, code) : 0;
+
+  for (i = 0; i < count; i += n) {
+    n = min(count - i, UNIJOY_BENCH_BATCH);
+
+    rcu_read_lock();
+    local_irq_save(flags);
+    start = ktime_get();
+    for (j = 0; j < n; j++)
+      unijoy_inph_event(&source->handle, type, code,
+                        type == EV_ABS ? value + (j & 1) : !(j & 1));
+    total += ktime_to_ns(ktime_sub(ktime_get(), start));
+    local_irq_restore(flags);
+    rcu_read_unlock();
+  }
+
+  if (type == EV_ABS) {
+    rcu_read_lock();
+    local_irq_save(flags);
+    unijoy_inph_event(&source->handle, type, code, value);
+    local_irq_restore(flags);
+    rcu_read_unlock();
+  }
+
+  unijoy_bench.events = count;
+  unijoy_bench.total = total;
+}
+
+/*
+ * Programs have no jumps, so a single pass over instructions proves
+ * they terminate and never leave the stack.
+ */
+static bool unijoy_sysfs_verify(struct unijoy_inph_insn *code, int length) {
+  int depth = 0;
+  int i;
+
+  for (i = 0; i < length; i++) {
+    switch (code[i].op) {
+      case UNIJOY_OP_AXIS:
+        if (code[i].arg < 0 || code[i].arg >= ABS_CNT)
+          return false;
+        break;
+      case UNIJOY_OP_BUTTON:
+        if (code[i].arg < 0 || code[i].arg >= UNIJOY_MAX_BUTTONS)
+          return false;
+        break;
+      case UNIJOY_OP_SHR:
+        if (code[i].arg < 0 || code[i].arg > 31)
+          return false;
+        break;
+    }
+
+    depth -= unijoy_inph_opcode_pops[code[i].op];
+    if (depth < 0)
+      return false;
+    depth++;
+    if (depth > UNIJOY_PROGRAM_STACK)
+      return false;
+  }
+
+  return depth == 1;
+}
+
+/* Input handlers implementation */
+
+static bool unijoy_inph_match(struct input_handler *handler, 
+                              struct input_dev *dev) {
+  if (test_bit(EV_KEY, dev->evbit) && test_bit(BTN_TOUCH, dev->keybit))
+    return false;
 
   if (test_bit(EV_KEY, dev->evbit) && test_bit(BTN_DIGI, dev->keybit))
     return false;
 
-  return true;
+  if (unijoy_allowlist.total && !unijoy_inph_allowed(dev)) {
+    unijoy_inph_ignore(dev);
+    return false;
+  }
+
+  return true;
+}
+
+/* Joysticks with keys are left to unijoy_inph, which attaches them anyway. */
+static bool unijoy_inph_kbd_match(struct input_handler *handler,
+                                  struct input_dev *dev) {
+  if (unijoy_inph_joystick(dev) || !unijoy_inph_keyboard(dev))
+    return false;
+
+  return unijoy_inph_match(handler, dev);
+}
+
+static int unijoy_inph_allowlist(void) {
+  struct unijoy_inph_allow *entry;
+  unsigned long long id;
+  char *ptr;
+  int i;
+
+  for (i = 0; i < unijoy_allow_count; i++) {
+    entry = &unijoy_allowlist.entries[i];
+    ptr = strchr(unijoy_allow[i], ':');
+
+    if (!ptr) {
+      if (kstrtoull(unijoy_allow[i], 10, &id) || !id)
+        return -EINVAL;
+      entry->id = id;
+      continue;
+    }
+
+    if (sscanf(unijoy_allow[i], "%x:", &entry->vendor) != 1)
+      return -EINVAL;
+    if (!strcmp(ptr + 1, "*"))
+      entry->product = -1;
+    else if (kstrtoint(ptr + 1, 16, &entry->product))
+      return -EINVAL;
+  }
+
+  unijoy_allowlist.total = unijoy_allow_count;
+  return 0;
+}
+
+static bool unijoy_inph_allowed(struct input_dev *dev) {
+  struct unijoy_inph_allow *entry;
+  __u64 id = unijoy_inph_id(dev);
+  int i;
+
+  for (i = 0; i < unijoy_allowlist.total; i++) {
+    entry = &unijoy_allowlist.entries[i];
+    if (entry->id) {
+      if (entry->id == id)
+        return true;
+    } else if (entry->vendor == dev->id.vendor &&
+               (entry->product < 0 || entry->product == dev->id.product)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void unijoy_inph_ignore(struct input_dev *dev) {
+  struct unijoy_inph_ignored *ignored = 0;
+  __u64 id = unijoy_inph_id(dev);
+  int i;
+
+  spin_lock(&unijoy_sysfs.sources_lock);
+
+  for (i = 0; i < unijoy_allowlist.ignored_total && !ignored; i++) {
+    if (unijoy_allowlist.ignored[i].id == id)
+      ignored = &unijoy_allowlist.ignored[i];
+  }
+
+  if (!ignored) {
+    ignored = &unijoy_allowlist.ignored[unijoy_allowlist.ignored_next];
+    unijoy_allowlist.ignored_next =
+      (unijoy_allowlist.ignored_next + 1) % UNIJOY_IGNORED_MAX;
+    if (unijoy_allowlist.ignored_total < UNIJOY_IGNORED_MAX)
+      unijoy_allowlist.ignored_total++;
+  }
+
+  ignored->id = id;
+  ignored->axis_total = bitmap_weight(dev->absbit, ABS_CNT);
+  ignored->buttons_total = bitmap_weight(dev->keybit, KEY_CNT);
+  strlcpy(ignored->name, dev->name ? dev->name : "", UNIJOY_IGNORED_NAME);
+
+  spin_unlock(&unijoy_sysfs.sources_lock);
+}
+
+/* Tells whether device matches unijoy_inph_ids the way input core does. */
+static bool unijoy_inph_joystick(struct input_dev *dev) {
+  const struct input_device_id *id;
+
+  for (id = unijoy_inph_ids; id->flags; id++) {
+    if (bitmap_subset(id->evbit, dev->evbit, EV_MAX) &&
+        bitmap_subset(id->absbit, dev->absbit, ABS_MAX) &&
+        bitmap_subset(id->keybit, dev->keybit, KEY_MAX))
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Button boxes enumerate as keyboards with a handful of keys, so any
+ * device with keys (but not a mouse) qualifies.
+ */
+static bool unijoy_inph_keyboard(struct input_dev *dev) {
+  if (test_bit(EV_REL, dev->evbit))
+    return false;
+
+  return find_next_bit(dev->keybit, BTN_MISC, KEY_ESC) < BTN_MISC;
+}
+
+/*
+ * Motion sensors of controllers carry the same input_id as controller
+ * itself, they are told apart by the top bit, which bus never uses.
+ */
+static __u64 unijoy_inph_id(struct input_dev *dev) {
+  __u64 id = ((__u64)dev->id.bustype << 48)
+           | ((__u64)dev->id.vendor  << 32)
+           | ((__u64)dev->id.product << 16)
+           | ((__u64)dev->id.version      );
+
+#ifdef INPUT_PROP_ACCELEROMETER
+  if (test_bit(INPUT_PROP_ACCELEROMETER, dev->propbit))
+    id |= UNIJOY_ID_MOTION;
+#endif
+
+  return id;
+}
+
+static int unijoy_inph_correct(int value, struct js_corr *corr) {
+	switch (corr->type) {
+
+		case JS_CORR_NONE:
+			break;
+
+		case JS_CORR_BROKEN:
+			value = value > corr->coef[0] ? (value < corr->coef[1] ? 0 :
+					((corr->coef[3] * (value - corr->coef[1])) >> 14)) :
+				((corr->coef[2] * (value - corr->coef[0])) >> 14);
+			break;
+
+		default:
+			return 0;
+	}
+
+	return value < SHRT_MIN ? SHRT_MIN : (value > SHRT_MAX ? SHRT_MAX : value);
+}
+
+/*
+ * Integer-only smoothing of destination axis values, state is kept in
+ * UNIJOY_FILTER_FRACTION fixed point. Median window is at most five
+ * samples, adaptive filter lowers averaging shift by one per every
+ * doubling of axis speed, so every type costs a few dozen cycles.
+ */
+static int unijoy_inph_filter(struct unijoy_inph_filter *filter, int value) {
+  __s16 sorted[UNIJOY_FILTER_MAX_WINDOW];
+  int i, j, t, shift;
+
+  if (!filter->primed) {
+    filter->acc = value * (1 << UNIJOY_FILTER_FRACTION);
+    for (i = 0; i < UNIJOY_FILTER_MAX_WINDOW; i++)
+      filter->samples[i] = value;
+    filter->primed = true;
+    return value;
+  }
+
+  switch (filter->type) {
+    case UNIJOY_FILTER_EMA:
+      filter->acc += (value * (1 << UNIJOY_FILTER_FRACTION) - filter->acc)
+                     >> filter->shift;
+      return filter->acc >> UNIJOY_FILTER_FRACTION;
+
+    case UNIJOY_FILTER_MEDIAN:
+      filter->samples[filter->pos] = value;
+      filter->pos = (filter->pos + 1) % filter->window;
+      for (i = 0; i < filter->window; i++) {
+        t = filter->samples[i];
+        for (j = i; j > 0 && sorted[j-1] > t; j--)
+          sorted[j] = sorted[j-1];
+        sorted[j] = t;
+      }
+      return sorted[filter->window / 2];
+
+    case UNIJOY_FILTER_ADAPTIVE:
+      t = abs(value - (filter->acc >> UNIJOY_FILTER_FRACTION)) >> filter->beta;
+      shift = filter->shift - min_t(int, fls(t), filter->shift);
+      filter->acc += (value * (1 << UNIJOY_FILTER_FRACTION) - filter->acc)
+                     >> shift;
+      return filter->acc >> UNIJOY_FILTER_FRACTION;
+
+    default:
+      return value;
+  }
+}
+
+static int unijoy_inph_range(struct unijoy_inph_map *map, int value) {
+  __s64 out = (value * map->scale + map->offset) >> UNIJOY_RANGE_FRACTION;
+
+  return out < SHRT_MIN ? SHRT_MIN : (out > SHRT_MAX ? SHRT_MAX : out);
+}
+
+/*
+ * Motion sensors report at up to 1 kHz, so their values are averaged (or,
+ * for gyro, integrated into angle) and let through at most once per
+ * period. There is no timer, values are let through upon samples, which
+ * motion sensors keep sending all the time. Angle is held within axis
+ * range, so turning back moves axis right away.
+ */
+static bool unijoy_inph_motion(struct unijoy_inph_motion *motion,
+                               int *value, ktime_t time) {
+  s64 now = ktime_to_ns(time);
+  s64 limit, dt;
+
+  if (motion->integrate) {
+    dt = now - motion->sampled;
+    if (motion->sampled && dt > 0 && dt < NSEC_PER_SEC) {
+      limit = (s64)SHRT_MAX << motion->shift;
+      motion->angle += *value * div_s64(dt, NSEC_PER_USEC);
+      motion->angle = motion->angle < -limit ? -limit :
+                      (motion->angle > limit ? limit : motion->angle);
+    }
+    motion->sampled = now;
+  } else {
+    motion->sum += *value;
+    motion->count++;
+  }
+
+  if (now - motion->emitted < motion->period)
+    return false;
+  motion->emitted = now;
+
+  if (motion->integrate) {
+    *value = motion->angle >> motion->shift;
+  } else {
+    /* Stage may have been reset by sysfs since this sample was counted */
+    if (!motion->count)
+      return false;
+    *value = div_s64(motion->sum, motion->count);
+    motion->sum = 0;
+    motion->count = 0;
+  }
+
+  return true;
+}
+
+/* Remembers untrimmed value, so trim buttons can re-emit axis alone. */
+static int unijoy_inph_trimmed(struct unijoy_inph_trim *trim, int value) {
+  trim->base = value;
+  value += trim->offset;
+
+  return value < SHRT_MIN ? SHRT_MIN : (value > SHRT_MAX ? SHRT_MAX : value);
+}
+
+static void unijoy_inph_trim(struct unijoy_inph_source *source, int number,
+                             ktime_t time) {
+  struct unijoy_inph_trim *trim;
+  int i, out;
+
+  for (i = 0; i < ABS_CNT; i++) {
+    trim = &output.trims[i];
+    if (!trim->enabled || trim->source != source)
+      continue;
+
+    if (number == trim->up)
+      trim->offset = min(trim->offset + trim->step, SHRT_MAX);
+    else if (number == trim->down)
+      trim->offset = max(trim->offset - trim->step, -SHRT_MAX);
+    else if (number == trim->center)
+      trim->offset = 0;
+    else
+      continue;
+
+    out = unijoy_inph_trimmed(trim, trim->base);
+    if (output.filters[i].type != UNIJOY_FILTER_NONE)
+      out = unijoy_inph_filter(&output.filters[i], out);
+    unijoy_inph_enqueue_axis(i, out, time);
+    unijoy_inph_report(JS_EVENT_AXIS, i, out);
+  }
+}
+
+/* Program is verified upon upload, nothing is checked here. */
+static int unijoy_inph_eval(struct unijoy_inph_program *program) {
+  int stack[UNIJOY_PROGRAM_STACK];
+  struct unijoy_inph_insn *insn;
+  int sp = 0;
+  int i;
+
+  for (i = 0; i < program->length; i++) {
+    insn = &program->code[i];
+    sp -= unijoy_inph_opcode_pops[insn->op];
+
+    switch (insn->op) {
+      case UNIJOY_OP_INPUT:
+        stack[sp] = program->input;
+        break;
+      case UNIJOY_OP_PUSH:
+        stack[sp] = insn->arg;
+        break;
+      case UNIJOY_OP_AXIS:
+        stack[sp] = output.dst_axis[insn->arg];
+        break;
+      case UNIJOY_OP_BUTTON:
+        stack[sp] = output.dst_buttons[insn->arg];
+        break;
+      case UNIJOY_OP_ADD:
+        stack[sp] = stack[sp] + stack[sp+1];
+        break;
+      case UNIJOY_OP_SUB:
+        stack[sp] = stack[sp] - stack[sp+1];
+        break;
+      case UNIJOY_OP_MUL:
+        stack[sp] = stack[sp] * stack[sp+1];
+        break;
+      case UNIJOY_OP_SHR:
+        stack[sp] = stack[sp] >> insn->arg;
+        break;
+      case UNIJOY_OP_NEG:
+        stack[sp] = -stack[sp];
+        break;
+      case UNIJOY_OP_ABS:
+        stack[sp] = abs(stack[sp]);
+        break;
+      case UNIJOY_OP_MIN:
+        stack[sp] = min(stack[sp], stack[sp+1]);
+        break;
+      case UNIJOY_OP_MAX:
+        stack[sp] = max(stack[sp], stack[sp+1]);
+        break;
+      case UNIJOY_OP_GT:
+        stack[sp] = stack[sp] > stack[sp+1];
+        break;
+      case UNIJOY_OP_LT:
+        stack[sp] = stack[sp] < stack[sp+1];
+        break;
+      case UNIJOY_OP_AND:
+        stack[sp] = stack[sp] && stack[sp+1];
+        break;
+      case UNIJOY_OP_OR:
+        stack[sp] = stack[sp] || stack[sp+1];
+        break;
+      case UNIJOY_OP_NOT:
+        stack[sp] = !stack[sp];
+        break;
+      case UNIJOY_OP_SELECT:
+        stack[sp] = stack[sp] ? stack[sp+1] : stack[sp+2];
+        break;
+    }
+
+    sp++;
+  }
+
+  return stack[0];
+}
+
+/*
+ * Programs may read any destination, so all of them are re-evaluated
+ * after every dispatched event. Only changed results are emitted.
+ */
+static void unijoy_inph_run(ktime_t time) {
+  struct unijoy_inph_program *program;
+  unsigned long flags;
+  int i, value;
+
+  spin_lock_irqsave(&output.program_lock, flags);
+
+  for (i = 0; i < UNIJOY_MAX_PROGRAMS; i++) {
+    program = &output.programs[i];
+    if (!program->active)
+      continue;
+
+    value = unijoy_inph_eval(program);
+    if (program->button)
+      value = value != 0;
+    else
+      value = value < SHRT_MIN ? SHRT_MIN :
+              (value > SHRT_MAX ? SHRT_MAX : value);
+
+    if (value == program->last)
+      continue;
+    program->last = value;
+
+    if (program->button) {
+      unijoy_inph_enqueue(UNIJOY_ACTION_EMMIT_BUTTON, program->number,
+                          value, time);
+      unijoy_inph_report(JS_EVENT_BUTTON, program->number, value);
+    } else {
+      unijoy_inph_enqueue_axis(program->number, value, time);
+      unijoy_inph_report(JS_EVENT_AXIS, program->number, value);
+    }
+  }
+
+  spin_unlock_irqrestore(&output.program_lock, flags);
+}
+
+/*
+ * Stores new value of one input of shared destination and tells whether
+ * value picked by policy out of all inputs changed, so destination gets
+ * a single coherent value no matter how many of them moved.
+ */
+static bool unijoy_inph_resolve(struct unijoy_inph_share *share, int input,
+                                int *value, ktime_t time) {
+  unsigned long flags;
+  bool changed;
+
+  spin_lock_irqsave(&output.share_lock, flags);
+  changed = unijoy_inph_resolve_locked(share, input, value, time);
+  spin_unlock_irqrestore(&output.share_lock, flags);
+
+  return changed;
+}
+
+/* Same as unijoy_inph_resolve, for callers already holding share_lock. */
+static bool unijoy_inph_resolve_locked(struct unijoy_inph_share *share,
+                                       int input, int *value, ktime_t time) {
+  bool moved, changed;
+  int i, out = 0;
+
+  moved = share->values[input] != *value;
+  share->values[input] = *value;
+
+  switch (share->policy) {
+    case UNIJOY_SHARE_LATEST:
+      if (moved && (input == share->owner ||
+                    ktime_to_ns(ktime_sub(time, share->moved)) >=
+                      share->hold)) {
+        share->owner = input;
+        share->moved = time;
+      }
+      out = share->values[share->owner];
+      break;
+    case UNIJOY_SHARE_DEFLECTION:
+      for (i = 0; i <= share->extras; i++) {
+        if (abs(share->values[i]) > abs(out)) {
+          out = share->values[i];
+          share->owner = i;
+        }
+      }
+      break;
+    case UNIJOY_SHARE_PRIORITY:
+      for (i = 0; i <= share->extras; i++) {
+        if (abs(share->values[i]) > share->param) {
+          out = share->values[i];
+          share->owner = i;
+          break;
+        }
+      }
+      break;
+    case UNIJOY_SHARE_ANY:
+      for (i = 0; i <= share->extras; i++)
+        out |= share->values[i] != 0;
+      break;
+    default:
+      out = *value;
+  }
+
+  changed = out != share->last;
+  share->last = out;
+
+  *value = out;
+  return changed;
+}
+
+/*
+ * Feeds inputs joined to shared destinations, mapped ones are fed first.
+ * Joined axis is calibrated by correction of its own source, then goes
+ * through range, trim, filter and motion stages of destination. Joined
+ * inputs are matched and resolved under share_lock, as sysfs may drop
+ * them meanwhile; resulting values are emitted after it is released.
+ */
+static void unijoy_inph_share(struct unijoy_inph_source *source,
+                              unsigned int type, unsigned int code,
+                              int number, int value, ktime_t time) {
+  int outs[UNIJOY_SHARE_MAX_INPUTS - 1];
+  struct unijoy_inph_share *share;
+  struct unijoy_inph_map *map;
+  bool button = type == EV_KEY;
+  unsigned long flags;
+  int i, j, k, count, dst_no, out;
+
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    share = &output.shares[i];
+    if (share->policy == UNIJOY_SHARE_NONE || share->button != button)
+      continue;
+
+    count = 0;
+    spin_lock_irqsave(&output.share_lock, flags);
+    dst_no = share->number;
+    map = button ? &output.source_buttons_map[dst_no] :
+                   &output.source_axis_map[dst_no];
+    for (j = 0; j < share->extras; j++) {
+      if (share->extra[j].source != source ||
+          share->extra[j].value != number)
+        continue;
+
+      out = value;
+      if (!button) {
+        out = unijoy_inph_axis_combined(dst_no,
+                                        &source->corrections[number], value);
+        if (static_branch_unlikely(&unijoy_motion_key) &&
+            output.motions[dst_no].rate &&
+            !unijoy_inph_motion(&output.motions[dst_no], &out, time))
+          continue;
+      }
+      if (unijoy_inph_resolve_locked(share, j + 1, &out, time))
+        outs[count++] = out;
+    }
+    spin_unlock_irqrestore(&output.share_lock, flags);
+
+    for (k = 0; k < count; k++) {
+      out = outs[k];
+      if (static_branch_unlikely(&unijoy_program_key) && map->program) {
+        output.programs[map->program - 1].input = out;
+      } else if (button) {
+        unijoy_inph_button_handlers[map->handler](dst_no, out, time);
+      } else {
+        unijoy_inph_enqueue_axis(dst_no, out, time);
+        unijoy_inph_report(JS_EVENT_AXIS, dst_no, out);
+      }
+      unijoy_tap_write(source, type, code, dst_no, out, time);
+    }
+  }
+}
+
+static struct unijoy_inph_source *unijoy_inph_create(struct input_dev *dev,
+                                                     __u64 id) {
+  struct unijoy_inph_source *source;
+  int i, j, t;
+
+  source = kzalloc(sizeof(struct unijoy_inph_source), GFP_KERNEL);
+  if (!source) {
+    return 0;
+  }
+
+  source->id = id;
+  source->name = dev->name;
+
+  for (i = 0; i < ABS_CNT; i++) {
+    if (test_bit(i, dev->absbit)) {
+      source->axis_map[i] = source->axis_total;
+      source->axis_revmap[source->axis_total] = i;
+      source->axis_total++;
+    }
+  }
+
+  for (i = BTN_JOYSTICK; i < KEY_CNT; i++) {
+    if (test_bit(i, dev->keybit)) {
+      source->button_map[i] = source->buttons_total;
+      source->button_revmap[source->buttons_total] = i;
+      source->buttons_total++;
+    }
+  }
+
+  for (i = BTN_MISC; i < BTN_JOYSTICK; i++) {
+    if (test_bit(i, dev->keybit)) {
+      source->button_map[i] = source->buttons_total;
+      source->button_revmap[source->buttons_total] = i;
+      source->buttons_total++;
+    }
+  }
+
+  /* Keyboard keys go last, so numbering of joystick buttons is kept. */
+  for (i = KEY_ESC; i < BTN_MISC; i++) {
+    if (test_bit(i, dev->keybit)) {
+      source->button_map[i] = source->buttons_total;
+      source->button_revmap[source->buttons_total] = i;
+      source->buttons_total++;
+    }
+  }
+
+  for (i = 0; i < source->axis_total; i++) {
+    j = source->axis_revmap[i];
+    if (input_abs_get_max(dev, j) == input_abs_get_min(dev, j)) {
+      source->corrections[i].type = JS_CORR_NONE;
+      continue;
+    }
+
+    source->corrections[i].type = JS_CORR_BROKEN;
+    source->corrections[i].prec = input_abs_get_fuzz(dev, j);
+
+    t = (input_abs_get_max(dev, j) + input_abs_get_min(dev, j)) / 2;
+    source->corrections[i].coef[0] = t - input_abs_get_flat(dev, j);
+    source->corrections[i].coef[1] = t + input_abs_get_flat(dev, j);
+    t = (input_abs_get_max(dev, j) - input_abs_get_min(dev, j)) / 2
+      - 2 * input_abs_get_flat(dev, j);
+    if (t) {
+      source->corrections[i].coef[2] = (1 << 29) / t;
+      source->corrections[i].coef[3] = (1 << 29) / t;
+    }
+
+    if (source->corrections[i].coef[0] == 0 &&
+        source->corrections[i].coef[1] == 0 &&
+        source->corrections[i].coef[2] == 1 << 14 &&
+        source->corrections[i].coef[3] == 1 << 14)
+      source->corrections[i].type = JS_CORR_NONE;
+  }
+
+  spin_lock(&unijoy_sysfs.sources_lock);
+  INIT_LIST_HEAD(&source->list);
+  list_add(&source->list, &unijoy_sysfs.sources.list);
+  if (++unijoy_memory.sources > unijoy_memory.sources_peak)
+    unijoy_memory.sources_peak = unijoy_memory.sources;
+  spin_unlock(&unijoy_sysfs.sources_lock);
+
+  return source;
+}
+
+static void unijoy_inph_relink(struct unijoy_inph_source *source, __u64 id) {
+  int i, j;
+  for (i = 0; i < output.buttons_total; i++) {
+    if (output.source_buttons_map[i].id == id) {
+      output.source_buttons_map[i].source = source;
+    }
+  }
+  for (i = 0; i < output.axis_total; i++) {
+    if (output.source_axis_map[i].id == id) {
+      output.source_axis_map[i].source = source;
+      unijoy_inph_select_axis(i);
+    }
+  }
+  for (i = 0; i < ABS_CNT; i++) {
+    if (output.trims[i].enabled && output.trims[i].id == id) {
+      output.trims[i].source = source;
+    }
+  }
+  for (i = 0; i < UNIJOY_MAX_SHARES; i++) {
+    for (j = 0; j < output.shares[i].extras; j++) {
+      if (output.shares[i].extra[j].id == id)
+        output.shares[i].extra[j].source = source;
+    }
+  }
+}
+
+static int unijoy_inph_connect(struct input_handler *handler,
+                               struct input_dev *dev,
+                               const struct input_device_id *in_id) {
+  struct unijoy_inph_source *source;
+  int error;
+  __u64 id;
+
+  id = unijoy_inph_id(dev);
+
+  if (id == 0)
+    return 0;
+
+  source = unijoy_sysfs_find(id);
+
+  /*
+   * Keyboards expose keys, consumer and system controls as separate
+   * devices under the same id, source with live handle is never reused.
+   */
+  if (source && source->state != UNIJOY_SOURCE_DISCONNECTED)
+    return -EBUSY;
+
+  if (!source) {
+    source = unijoy_inph_create(dev, id);
+    if (!source)
+      return -ENOMEM;
+  }
+
+  source->handle.dev     = input_get_device(dev);
+  source->handle.handler = handler;
+  source->handle.private = source;
+
+  error = input_register_handle(&source->handle);
+
+  if (error)
+    return error;
+
+  if (source->state == UNIJOY_SOURCE_DISCONNECTED)
+    unijoy_sysfs_resume(source);
+
+  return 0;
+}
+
+static void unijoy_inph_disconnect(struct input_handle *handle) {
+  struct unijoy_inph_source *source = handle->private;
+
+  if (!source)
+    return;
+
+  if (source->state == UNIJOY_SOURCE_MERGED) {
+    unijoy_sysfs_suspend(source);
+  } else {
+    unijoy_sysfs_remove(source);
+  }
+
+  input_unregister_handle(handle);
+}
+
+static int unijoy_thread_wakeup_condition(void) {
+  return unijoy_thread_pending() || kthread_should_stop();
+}
+
+static bool unijoy_thread_pending(void) {
+  return output.head != output.tail || output.full ||
+         output.axis_pending_count;
+}
+
+/* Main lane may be flushed by degraded path meanwhile, so it is rechecked. */
+static bool unijoy_thread_nextdata(struct unijoy_thread_data *data) {
+  bool taken = false;
+
+  spin_lock_irq(&output.buffer_lock);
+  if (output.head != output.tail || output.full) {
+    *data = output.buffer[output.tail++];
+    output.tail &= UNIJOY_BUFFER_SIZE - 1;
+    output.full = false;
+    taken = true;
+  }
+  spin_unlock_irq(&output.buffer_lock);
+
+  return taken;
+}
+
+/*
+ * Output events carry time of source events they were produced from,
+ * instead of time worker got to them. Kernels before 5.4 do not allow
+ * that, their events are stamped upon emitting.
+ */
+static void unijoy_thread_timestamp(ktime_t time) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+  input_set_timestamp(output.idev, time);
+#endif
+}
+
+#ifdef CONFIG_UNIJOY_STATS
+static void unijoy_thread_account(int lane, ktime_t time) {
+  u64 delay = ktime_to_ns(ktime_sub(ktime_get(), time));
+
+  output.lanes[lane].latency_total += delay;
+  output.lanes[lane].latency_count++;
+  if (delay > output.lanes[lane].latency_max)
+    output.lanes[lane].latency_max = delay;
+}
+#endif
+
+/*
+ * Virtual device is re-created only when the set of axes and buttons it
+ * advertises changed, other refreshes are counted as skipped. Time spent
+ * on both halves of re-creation is kept to be weighed against hotplug
+ * cost.
+ */
+static void unijoy_thread_refresh(void) {
+#ifdef CONFIG_UNIJOY_STATS
+  struct unijoy_thread_refresh_stats *refresh = &output.refresh;
+  ktime_t start;
+  u64 spent;
+#endif
+
+  if (unijoy_inph_unchanged()) {
+    output.refresh.skipped++;
+    return;
+  }
+
+#ifdef CONFIG_UNIJOY_STATS
+  start = ktime_get();
+  unijoy_inph_unregister();
+  spent = ktime_to_ns(ktime_sub(ktime_get(), start));
+  refresh->unregister_total += spent;
+  if (spent > refresh->unregister_max)
+    refresh->unregister_max = spent;
+
+  start = ktime_get();
+  unijoy_inph_register();
+  spent = ktime_to_ns(ktime_sub(ktime_get(), start));
+  refresh->register_total += spent;
+  if (spent > refresh->register_max)
+    refresh->register_max = spent;
+
+  refresh->count++;
+#else
+  unijoy_inph_unregister();
+  unijoy_inph_register();
+#endif
+}
+
+static void unijoy_thread_process(struct unijoy_thread_data *data,
+                                  int lane) {
+  int action = data->action;
+  int number = data->number;
+  int value  = data->value;
+
+  if (action != UNIJOY_ACTION_SYNC)
+    unijoy_state_update(action, number, value);
+
+#ifdef CONFIG_UNIJOY_STATS
+  if (action != UNIJOY_ACTION_REFRESH && action != UNIJOY_ACTION_SYNC)
+    unijoy_thread_account(lane, data->time);
+#endif
+
+  if (!output.idev && action != UNIJOY_ACTION_REFRESH)
+    return;
+
+  switch (action) {
+    case UNIJOY_ACTION_EMMIT_BUTTON:
+      unijoy_thread_timestamp(data->time);
+      input_report_key(output.idev, unijoy_inph_button_code(number), value);
+      input_sync(output.idev);
+      break;
+    case UNIJOY_ACTION_REFRESH:
+      unijoy_thread_refresh();
+      break;
+    case UNIJOY_ACTION_REPORT_BUTTON:
+      unijoy_thread_timestamp(data->time);
+      input_report_key(output.idev, unijoy_inph_button_code(number), value);
+      break;
+    case UNIJOY_ACTION_REPORT_AXIS:
+      unijoy_thread_timestamp(data->time);
+      input_report_abs(output.idev, number, value);
+      break;
+    case UNIJOY_ACTION_SYNC:
+      input_sync(output.idev);
+      break;
+  }
+}
+
+/*
+ * Emits latest values of all pending axes as a single frame. Samples
+ * which were overwritten while waiting are never emitted at all.
+ */
+static void unijoy_thread_drain_axes(void) {
+  DECLARE_BITMAP(pending, ABS_CNT);
+  struct unijoy_thread_data data;
+  int i;
+
+  spin_lock_irq(&output.buffer_lock);
+  bitmap_copy(pending, output.axis_pending, ABS_CNT);
+  spin_unlock_irq(&output.buffer_lock);
+
+  data.action = UNIJOY_ACTION_REPORT_AXIS;
+  for_each_set_bit(i, pending, ABS_CNT) {
+    spin_lock_irq(&output.buffer_lock);
+    if (!__test_and_clear_bit(i, output.axis_pending)) {
+      spin_unlock_irq(&output.buffer_lock);
+      continue;
+    }
+    output.axis_pending_count--;
+    data.number = i;
+    data.value = output.axis_value[i];
+    data.time = output.axis_time[i];
+    spin_unlock_irq(&output.buffer_lock);
+
+    unijoy_thread_process(&data, UNIJOY_LANE_AXIS);
+  }
+
+  data.action = UNIJOY_ACTION_SYNC;
+  unijoy_thread_process(&data, UNIJOY_LANE_AXIS);
+}
+
+/*
+ * Button edges, refreshes and neutralizing frames always go first,
+ * continuous axis updates are emitted once the main lane is empty.
+ * Lanes are drained by worker or, while it is stalled, by watchdog work,
+ * emit_lock keeps them one at a time.
+ */
+static void unijoy_thread_step(void) {
+  struct unijoy_thread_data data;
+
+  if (unijoy_thread_nextdata(&data))
+    unijoy_thread_process(&data, UNIJOY_LANE_MAIN);
+  else
+    unijoy_thread_drain_axes();
+}
+
+static int unijoy_thread(void *nulldata) {
+  while (1) {
+    wait_event_interruptible_timeout(output.wait,
+                                     unijoy_thread_wakeup_condition(),
+                                     unijoy_thread_timeout());
+    
+    if (kthread_should_stop()) 
+      return 0;
+
+    while (unijoy_thread_pending()) {
+      if (kthread_should_stop()) 
+        return 0;
+
+      mutex_lock(&output.emit_lock);
+      unijoy_thread_step();
+      mutex_unlock(&output.emit_lock);
+      output.drains++;
+    }
+
+    unijoy_thread_idle();
+  }
+  return 0;
+}
+
+/*
+ * Active worker sleeps until either an event or the moment it should
+ * go idle, idle one polls axis lane at low rate.
+ */
+static long unijoy_thread_timeout(void) {
+  long left;
+
+  if (!unijoy_idle_timeout)
+    return MAX_SCHEDULE_TIMEOUT;
+
+  if (output.idle)
+    return UNIJOY_IDLE_POLL;
+
+  left = (long)(output.active_at + unijoy_idle_timeout * HZ - jiffies);
+  return left > 0 ? left : 1;
+}
+
+/*
+ * Idle transitions are made under buffer_lock both ways, so a resume
+ * racing with worker going idle is never lost.
+ */
+static void unijoy_thread_idle(void) {
+  if (!unijoy_idle_timeout) {
+    output.idle = false;
+    return;
+  }
+
+  spin_lock_irq(&output.buffer_lock);
+  if (!output.idle &&
+      time_after(jiffies, output.active_at + unijoy_idle_timeout * HZ)) {
+    output.idle = true;
+    output.idles++;
+  }
+  spin_unlock_irq(&output.buffer_lock);
+}
+
+static void unijoy_inph_enqueue(int action, int number, int value,
+                                ktime_t time) {
+  unsigned long flags = 0;
+#ifdef CONFIG_UNIJOY_STATS
+  int depth;
+#endif
+
+  if (output.full) {
+    output.lanes[UNIJOY_LANE_MAIN].dropped++;
+    goto unlock_exit;
+  }
+
+  
+  spin_lock_irqsave(&output.buffer_lock, flags);
+  
+  output.buffer[output.head].action = action;
+  output.buffer[output.head].number = number;
+  output.buffer[output.head].value  = value;
+  output.buffer[output.head].time   = time;
+
+  output.head++;
+  output.head &= UNIJOY_BUFFER_SIZE - 1;
+
+  if (output.head == output.tail )
+    output.full = true;
+
+#ifdef CONFIG_UNIJOY_STATS
+  depth = output.full ? UNIJOY_BUFFER_SIZE :
+          (output.head - output.tail) & (UNIJOY_BUFFER_SIZE - 1);
+  if (depth > output.lanes[UNIJOY_LANE_MAIN].depth_max)
+    output.lanes[UNIJOY_LANE_MAIN].depth_max = depth;
+#endif
+
+  spin_unlock_irqrestore(&output.buffer_lock, flags);
+unlock_exit:
+  unijoy_inph_wake(true);
+
+  if (unlikely(unijoy_watchdog.health == UNIJOY_HEALTH_STALLED))
+    unijoy_watchdog_kick();
+}
+
+/*
+ * Axis lane never overflows: newer value of an axis simply replaces
+ * the one still waiting for the worker.
+ */
+static void unijoy_inph_enqueue_axis(int number, int value, ktime_t time) {
+  unsigned long flags;
+
+  spin_lock_irqsave(&output.buffer_lock, flags);
+
+  if (__test_and_set_bit(number, output.axis_pending)) {
+    output.lanes[UNIJOY_LANE_AXIS].dropped++;
+  } else {
+    output.axis_pending_count++;
+#ifdef CONFIG_UNIJOY_STATS
+    if (output.axis_pending_count > output.lanes[UNIJOY_LANE_AXIS].depth_max)
+      output.lanes[UNIJOY_LANE_AXIS].depth_max = output.axis_pending_count;
+#endif
+  }
+  output.axis_value[number] = value;
+  output.axis_time[number] = time;
+
+  spin_unlock_irqrestore(&output.buffer_lock, flags);
+
+  if (abs(value - output.idle_ref[number]) > unijoy_idle_threshold) {
+    output.idle_ref[number] = value;
+    unijoy_inph_wake(true);
+  } else {
+    unijoy_inph_wake(false);
+  }
+
+  if (unlikely(unijoy_watchdog.health == UNIJOY_HEALTH_STALLED))
+    unijoy_watchdog_kick();
+}
+
+/*
+ * Noise below idle threshold keeps idle worker asleep, it is drained
+ * upon the next poll.
+ */
+static void unijoy_inph_wake(bool significant) {
+  unsigned long flags;
+
+  if (significant) {
+    spin_lock_irqsave(&output.buffer_lock, flags);
+    output.active_at = jiffies;
+    if (unlikely(output.idle)) {
+      output.idle = false;
+      output.resumes++;
+    }
+    spin_unlock_irqrestore(&output.buffer_lock, flags);
+  }
+
+  if (!READ_ONCE(output.idle))
+    wake_up_interruptible(&output.wait);
 }
 
-static int unijoy_inph_correct(int value, struct js_corr *corr) {
-	switch (corr->type) {
+/*
+ * Destination state is kept for programs and for startup events of own
+ * joystick device, which is only fed when there is one. Every button
+ * has a byte of its own, so plain stores do.
+ */
+static void unijoy_inph_report(int type, int number, int value) {
+  if (type == JS_EVENT_BUTTON)
+    output.dst_buttons[number] = !!value;
+  else
+    output.dst_axis[number] = value;
+
+  if (unijoy_js_device)
+    unijoy_js_report(type, number, value);
+}
 
-		case JS_CORR_NONE:
-			break;
+/* Drops pending update of an axis, so it won't override newer frame. */
+static void unijoy_inph_cancel_axis(int number) {
+  unsigned long flags;
 
-		case JS_CORR_BROKEN:
-			value = value > corr->coef[0] ? (value < corr->coef[1] ? 0 :
-					((corr->coef[3] * (value - corr->coef[1])) >> 14)) :
-				((corr->coef[2] * (value - corr->coef[0])) >> 14);
-			break;
+  spin_lock_irqsave(&output.buffer_lock, flags);
+  if (__test_and_clear_bit(number, output.axis_pending))
+    output.axis_pending_count--;
+  spin_unlock_irqrestore(&output.buffer_lock, flags);
+}
 
-		default:
-			return 0;
-	}
+static void unijoy_inph_event(struct input_handle *handle,
+                              unsigned int type,
+                              unsigned int code,
+                              int value) {
 
-	return value < SHRT_MIN ? SHRT_MIN : (value > SHRT_MAX ? SHRT_MAX : value);
+  struct unijoy_inph_source *source = handle->private;
+  struct unijoy_inph_map *map;
+  int number;
+  ktime_t time;
+  int i;
+  int out;
+
+  if (!source)
+    return;
+
+  /* Typing on merged keyboard ends here, unless the key is mapped. */
+  if (type == EV_KEY && !test_bit(code, source->mapped_keys))
+    return;
+
+#ifdef CONFIG_UNIJOY_STATS
+  if (unlikely(source->resumed_at)) {
+    source->reconnect_latency = ktime_to_ns(ktime_get()) - source->resumed_at;
+    source->resumed_at = 0;
+  }
+#endif
+
+  switch (type) {
+    case EV_KEY:
+      if (value == 2)
+        return;
+      number = source->button_map[code];
+      time = unijoy_inph_timestamp(handle->dev);
+      if (static_branch_unlikely(&unijoy_trim_key) &&
+          source->trimming && value)
+        unijoy_inph_trim(source, number, time);
+      for (i = 0; i < output.buttons_total; i++) {
+        map = &output.source_buttons_map[i];
+        if (map->source == source && map->value == number) {
+          out = value;
+          if (static_branch_unlikely(&unijoy_share_key) && map->share &&
+              !unijoy_inph_resolve(&output.shares[map->share - 1], 0, &out,
+                                   time))
+            continue;
+          if (static_branch_unlikely(&unijoy_program_key) && map->program)
+            output.programs[map->program - 1].input = out;
+          else
+            unijoy_inph_button_handlers[map->handler](i, out, time);
+          unijoy_tap_write(source, type, code, i, out, time);
+        }
+      }
+      break;
+    case EV_ABS:
+      if (!test_bit(code, source->mapped_abs))
+        return;
+      number = source->axis_map[code];
+      time = unijoy_inph_timestamp(handle->dev);
+      for (i = 0; i < output.axis_total; i++) {
+        map = &output.source_axis_map[i];
+        if (map->source == source && map->value == number) {
+          out = unijoy_inph_axis_handlers[map->handler](
+                  i, &source->corrections[number], value);
+          if (static_branch_unlikely(&unijoy_motion_key) &&
+              output.motions[i].rate &&
+              !unijoy_inph_motion(&output.motions[i], &out, time))
+            continue;
+          if (static_branch_unlikely(&unijoy_share_key) && map->share &&
+              !unijoy_inph_resolve(&output.shares[map->share - 1], 0, &out,
+                                   time))
+            continue;
+          if (static_branch_unlikely(&unijoy_program_key) && map->program) {
+            output.programs[map->program - 1].input = out;
+          } else {
+            unijoy_inph_enqueue_axis(i, out, time);
+            unijoy_inph_report(JS_EVENT_AXIS, i, out);
+          }
+          unijoy_tap_write(source, type, code, i, out, time);
+        }
+      }
+      break;
+    case EV_SYN:
+#ifdef CONFIG_UNIJOY_STATS
+      if (code == SYN_REPORT)
+        unijoy_inph_frame(source, unijoy_inph_timestamp(handle->dev));
+#endif
+      return;
+    default:
+      return;
+  }
+
+  if (static_branch_unlikely(&unijoy_share_key))
+    unijoy_inph_share(source, type, code, number, value, time);
+
+  if (static_branch_unlikely(&unijoy_program_key))
+    unijoy_inph_run(time);
 }
 
-static struct unijoy_inph_source *unijoy_inph_create(struct input_dev *dev,
-                                                     __u64 id) {
-  struct unijoy_inph_source *source;
-  int i, j, t;
+#ifdef CONFIG_UNIJOY_STATS
+/*
+ * Frame intervals are tracked the way TCP tracks round trip time: moving
+ * average with 1/8 gain and mean deviation (reported as jitter) with 1/4
+ * gain. Input core passes only frames which changed something, so pause
+ * longer than UNIJOY_FRAME_REST_MS is taken for device at rest rather
+ * than for a gap.
+ */
+static void unijoy_inph_frame(struct unijoy_inph_source *source,
+                              ktime_t time) {
+  s64 now = ktime_to_ns(time);
+  s64 interval = now - source->frame_at;
+  s64 delta;
 
-  source = kzalloc(sizeof(struct unijoy_inph_source), GFP_KERNEL);
-  if (!source) {
+  source->frames++;
+
+  if (!source->frame_at) {
+    source->frame_at = now;
+    return;
+  }
+  source->frame_at = now;
+
+  if (interval <= 0 || interval > UNIJOY_FRAME_REST_MS * NSEC_PER_MSEC)
+    return;
+
+  if (unijoy_gap_ms && interval > unijoy_gap_ms * NSEC_PER_MSEC)
+    source->gaps++;
+
+  if (interval > source->interval_max)
+    source->interval_max = interval;
+
+  if (!source->interval_avg) {
+    source->interval_avg = interval;
+    return;
+  }
+
+  delta = interval - source->interval_avg;
+  source->interval_avg += delta >> 3;
+  source->interval_dev += ((delta < 0 ? -delta : delta) -
+                           source->interval_dev) >> 2;
+}
+#endif
+
+static void unijoy_inph_refresh(void) {
+  unijoy_inph_enqueue(UNIJOY_ACTION_REFRESH, 0, 0, ktime_get());
+}
+
+/*
+ * Removed destination is not necessarily reset by re-registration of
+ * virtual device anymore, so it is released explicitly.
+ */
+static void unijoy_inph_release(int action, int dst_no) {
+  ktime_t now = ktime_get();
+
+  if (action == UNIJOY_ACTION_REPORT_BUTTON) {
+    unijoy_inph_behaviour_stop(dst_no);
+    unijoy_inph_report(JS_EVENT_BUTTON, dst_no, 0);
+  } else {
+    unijoy_inph_cancel_axis(dst_no);
+    unijoy_inph_report(JS_EVENT_AXIS, dst_no, 0);
+  }
+  unijoy_inph_enqueue(action, dst_no, 0, now);
+  unijoy_inph_enqueue(UNIJOY_ACTION_SYNC, 0, 0, now);
+}
+
+/*
+ * Time of the frame source event belongs to, as set by its driver or
+ * by input core upon its arrival. Older kernels do not track it, but
+ * handlers are called right upon arrival anyway.
+ */
+static ktime_t unijoy_inph_timestamp(struct input_dev *dev) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+  return input_get_timestamp(dev)[INPUT_CLK_MONO];
+#else
+  return ktime_get();
+#endif
+}
+
+static int unijoy_inph_button_code(int dst_no) {
+  if (dst_no+BTN_JOYSTICK < KEY_MAX)
+    return dst_no+BTN_JOYSTICK;
+  return (dst_no+BTN_JOYSTICK) - KEY_MAX + BTN_MISC;
+}
+
+/*
+ * Configuration picks the cheapest handler able to do everything set up
+ * for destination, so dispatch calls it through table index without
+ * testing any of transforms itself.
+ */
+static void unijoy_inph_select_button(int dst_no) {
+  output.source_buttons_map[dst_no].handler =
+    output.behaviours[dst_no].type != UNIJOY_BEHAVIOUR_NONE ?
+      UNIJOY_HANDLER_BEHAVIOUR : UNIJOY_HANDLER_COPY;
+}
+
+static void unijoy_inph_select_axis(int dst_no) {
+  struct unijoy_inph_map *map = &output.source_axis_map[dst_no];
+  int handler = UNIJOY_HANDLER_COPY;
+
+  if (map->source &&
+      map->source->corrections[map->value].type != JS_CORR_NONE)
+    handler = UNIJOY_HANDLER_LINEAR;
+
+  if (map->ranged)
+    handler = UNIJOY_HANDLER_RANGED;
+
+  if (output.trims[dst_no].enabled ||
+      output.filters[dst_no].type != UNIJOY_FILTER_NONE)
+    handler = UNIJOY_HANDLER_COMBINED;
+
+  map->handler = handler;
+}
+
+static void unijoy_inph_button_copy(int dst_no, int value, ktime_t time) {
+  unijoy_inph_enqueue(UNIJOY_ACTION_EMMIT_BUTTON, dst_no, value, time);
+  unijoy_inph_report(JS_EVENT_BUTTON, dst_no, value);
+}
+
+static int unijoy_inph_axis_copy(int dst_no, struct js_corr *corr,
+                                 int value) {
+  return value < SHRT_MIN ? SHRT_MIN : (value > SHRT_MAX ? SHRT_MAX : value);
+}
+
+static int unijoy_inph_axis_linear(int dst_no, struct js_corr *corr,
+                                   int value) {
+  value = value > corr->coef[0] ? (value < corr->coef[1] ? 0 :
+          ((corr->coef[3] * (value - corr->coef[1])) >> 14)) :
+          ((corr->coef[2] * (value - corr->coef[0])) >> 14);
+
+  return value < SHRT_MIN ? SHRT_MIN : (value > SHRT_MAX ? SHRT_MAX : value);
+}
+
+static int unijoy_inph_axis_ranged(int dst_no, struct js_corr *corr,
+                                   int value) {
+  return unijoy_inph_range(&output.source_axis_map[dst_no],
+                           unijoy_inph_correct(value, corr));
+}
+
+static int unijoy_inph_axis_combined(int dst_no, struct js_corr *corr,
+                                     int value) {
+  value = unijoy_inph_correct(value, corr);
+  if (output.source_axis_map[dst_no].ranged)
+    value = unijoy_inph_range(&output.source_axis_map[dst_no], value);
+  if (output.trims[dst_no].enabled)
+    value = unijoy_inph_trimmed(&output.trims[dst_no], value);
+  if (output.filters[dst_no].type != UNIJOY_FILTER_NONE)
+    value = unijoy_inph_filter(&output.filters[dst_no], value);
+  return value;
+}
+
+/*
+ * Source button of a destination with behaviour only starts or stops
+ * it, destination itself is driven by behaviour timer, which emits
+ * through the same queue as plain buttons do.
+ */
+static void unijoy_inph_behave(int dst_no, int value, ktime_t time) {
+  struct unijoy_inph_behaviour *behaviour = &output.behaviours[dst_no];
+  unsigned long flags;
+
+  spin_lock_irqsave(&output.behaviour_lock, flags);
+
+  behaviour->held = value;
+
+  switch (behaviour->type) {
+    case UNIJOY_BEHAVIOUR_TOGGLE:
+      if (value)
+        unijoy_inph_behaviour_emit(behaviour, !behaviour->state, time);
+      break;
+    case UNIJOY_BEHAVIOUR_PULSE:
+      if (!value)
+        break;
+      unijoy_inph_behaviour_emit(behaviour, 1, time);
+      hrtimer_start(&behaviour->timer, behaviour->on, HRTIMER_MODE_REL);
+      break;
+    case UNIJOY_BEHAVIOUR_TURBO:
+      if (!value) {
+        if (behaviour->state)
+          unijoy_inph_behaviour_emit(behaviour, 0, time);
+        break;
+      }
+      unijoy_inph_behaviour_emit(behaviour, 1, time);
+      hrtimer_start(&behaviour->timer, behaviour->on, HRTIMER_MODE_REL);
+      break;
+    case UNIJOY_BEHAVIOUR_SEQUENCE:
+      if (!value)
+        break;
+      behaviour->left = 2 * behaviour->params[2] - 1;
+      unijoy_inph_behaviour_emit(behaviour, 1, time);
+      hrtimer_start(&behaviour->timer, behaviour->on, HRTIMER_MODE_REL);
+      break;
+    default:
+      break;
+  }
+
+  spin_unlock_irqrestore(&output.behaviour_lock, flags);
+}
+
+static void unijoy_inph_behaviour_emit(struct unijoy_inph_behaviour *behaviour,
+                                       int value, ktime_t time) {
+  int dst_no = behaviour - output.behaviours;
+
+  behaviour->state = value;
+  unijoy_inph_enqueue(UNIJOY_ACTION_EMMIT_BUTTON, dst_no, value, time);
+  unijoy_inph_report(JS_EVENT_BUTTON, dst_no, value);
+}
+
+/*
+ * Forgets whatever behaviour was doing, its timer is left to expire
+ * idly. Destination is not released here, callers do that.
+ */
+static void unijoy_inph_behaviour_stop(int dst_no) {
+  struct unijoy_inph_behaviour *behaviour = &output.behaviours[dst_no];
+  unsigned long flags;
+
+  spin_lock_irqsave(&output.behaviour_lock, flags);
+  behaviour->held = false;
+  behaviour->state = false;
+  behaviour->left = 0;
+  spin_unlock_irqrestore(&output.behaviour_lock, flags);
+}
+
+static enum hrtimer_restart unijoy_inph_behaviour_timer(struct hrtimer *timer) {
+  struct unijoy_inph_behaviour *behaviour =
+    container_of(timer, struct unijoy_inph_behaviour, timer);
+  enum hrtimer_restart restart = HRTIMER_NORESTART;
+  unsigned long flags;
+
+  spin_lock_irqsave(&output.behaviour_lock, flags);
+
+  switch (behaviour->type) {
+    case UNIJOY_BEHAVIOUR_PULSE:
+      if (behaviour->state)
+        unijoy_inph_behaviour_emit(behaviour, 0, ktime_get());
+      break;
+    case UNIJOY_BEHAVIOUR_TURBO:
+      if (!behaviour->held)
+        break;
+      unijoy_inph_behaviour_emit(behaviour, !behaviour->state, ktime_get());
+      hrtimer_forward_now(timer, behaviour->on);
+      restart = HRTIMER_RESTART;
+      break;
+    case UNIJOY_BEHAVIOUR_SEQUENCE:
+      if (behaviour->left <= 0)
+        break;
+      unijoy_inph_behaviour_emit(behaviour, !behaviour->state, ktime_get());
+      if (--behaviour->left == 0)
+        break;
+      hrtimer_forward_now(timer, behaviour->state ? behaviour->on :
+                                                    behaviour->off);
+      restart = HRTIMER_RESTART;
+      break;
+    default:
+      break;
+  }
+
+  spin_unlock_irqrestore(&output.behaviour_lock, flags);
+
+  return restart;
+}
+
+static void unijoy_inph_unregister(void) {
+  if (output.idev) {
+    input_unregister_device(output.idev);
+    input_free_device(output.idev);
+    output.idev = 0;
+  }
+}
+static void unijoy_inph_register(void) {
+  struct input_dev *idev = 0;
+
+  if (output.axis_total <0 && output.buttons_total < 0)
+    return;
+
+  if (!unijoy_input_device)
+    return;
+
+  idev = input_allocate_device();
+  idev->name = UNIJOY_NAME;
+  input_alloc_absinfo(idev);
+
+  unijoy_inph_capabilities(idev->evbit, idev->keybit, idev->absbit);
+
+  if (input_register_device(idev)) {
+    input_free_device(idev);
+  } else {
+    output.idev = idev;
+  }
+}
+
+static void unijoy_inph_capabilities(unsigned long *evbit,
+                                     unsigned long *keybit,
+                                     unsigned long *absbit) {
+  int i;
+
+  if (output.buttons_total > 0) {
+    set_bit(EV_KEY, evbit);
+    for (i = 0; i < output.buttons_total; i++) {
+      set_bit(unijoy_inph_button_code(i), keybit);
+    }
+  }
+
+  if (output.axis_total > 0) {
+    set_bit(EV_ABS, evbit);
+    for (i = 0; i < output.axis_total; i++) {
+      set_bit(i, absbit);
+    }
+  }
+}
+
+/*
+ * Capabilities depend on totals of destinations only, so retargeting
+ * one, removing one in the middle or merging a device with nothing
+ * mapped yet leaves virtual device (and its readers) as is. Input core
+ * adds EV_SYN upon registration.
+ */
+static bool unijoy_inph_unchanged(void) {
+  DECLARE_BITMAP(evbit, EV_CNT);
+  DECLARE_BITMAP(keybit, KEY_CNT);
+  DECLARE_BITMAP(absbit, ABS_CNT);
+
+  if (!output.idev)
+    return !unijoy_input_device;
+
+  bitmap_zero(evbit, EV_CNT);
+  bitmap_zero(keybit, KEY_CNT);
+  bitmap_zero(absbit, ABS_CNT);
+
+  unijoy_inph_capabilities(evbit, keybit, absbit);
+  __set_bit(EV_SYN, evbit);
+
+  return bitmap_equal(evbit, output.idev->evbit, EV_CNT) &&
+         bitmap_equal(keybit, output.idev->keybit, KEY_CNT) &&
+         bitmap_equal(absbit, output.idev->absbit, ABS_CNT);
+}
+
+/* Joystick device implementation */
+
+static int unijoy_js_setup(void) {
+  int error;
+  int dev_no;
+
+  if (!unijoy_js_device)
     return 0;
+
+  INIT_LIST_HEAD(&unijoy_js.client_list);
+  spin_lock_init(&unijoy_js.client_lock);
+  init_waitqueue_head(&unijoy_js.wait);
+
+  unijoy_js.minor = input_get_new_minor(UNIJOY_MINOR_BASE, UNIJOY_MINORS, true);
+  if (unijoy_js.minor < 0)
+    return unijoy_js.minor;
+
+  dev_no = unijoy_js.minor;
+  if (dev_no < UNIJOY_MINOR_BASE + UNIJOY_MINORS)
+    dev_no -= UNIJOY_MINOR_BASE;
+
+  dev_set_name(&unijoy_js.dev, "js%d", dev_no);
+  unijoy_js.dev.devt = MKDEV(INPUT_MAJOR, unijoy_js.minor);
+  unijoy_js.dev.class = &input_class;
+  unijoy_js.dev.release = unijoy_js_free_device;
+  device_initialize(&unijoy_js.dev);
+
+  cdev_init(&unijoy_js.cdev, &unijoy_js_fops);
+  unijoy_js.cdev.kobj.parent = &unijoy_js.dev.kobj;
+
+  error = cdev_add(&unijoy_js.cdev, unijoy_js.dev.devt, 1);
+  if (error)
+    goto err_put_device;
+
+  error = device_add(&unijoy_js.dev);
+  if (error)
+    goto err_del_cdev;
+
+  unijoy_js.exist = true;
+  return 0;
+
+err_del_cdev:
+  cdev_del(&unijoy_js.cdev);
+err_put_device:
+  put_device(&unijoy_js.dev);
+  input_free_minor(unijoy_js.minor);
+  return error;
+}
+
+static void unijoy_js_free(void) {
+  if (!unijoy_js_device)
+    return;
+
+  unijoy_js.exist = false;
+  wake_up_interruptible(&unijoy_js.wait);
+
+  device_del(&unijoy_js.dev);
+  cdev_del(&unijoy_js.cdev);
+  put_device(&unijoy_js.dev);
+  input_free_minor(unijoy_js.minor);
+}
+
+/* Device is a part of static module state, nothing to free here. */
+static void unijoy_js_free_device(struct device *dev) {
+}
+
+/*
+ * Called straight from dispatch path (and upon neutralizing of
+ * unplugged sources), so readers of this device never wait for
+ * unijoy_thread nor for virtual input device.
+ */
+static void unijoy_js_report(int type, int number, int value) {
+  struct unijoy_js_client *client;
+  struct js_event event;
+  unsigned long flags;
+
+  if (type == JS_EVENT_BUTTON && number >= UNIJOY_JS_MAX_BUTTONS)
+    return;
+
+  if (!unijoy_js.clients)
+    return;
+
+  event.time = jiffies_to_msecs(jiffies);
+  event.type = type;
+  event.number = number;
+  event.value = value;
+
+  spin_lock_irqsave(&unijoy_js.client_lock, flags);
+  list_for_each_entry(client, &unijoy_js.client_list, node) {
+    spin_lock(&client->buffer_lock);
+    client->buffer[client->head] = event;
+    if (client->startup == unijoy_js_startup_total()) {
+      client->head++;
+      client->head &= UNIJOY_JS_BUFFER_SIZE - 1;
+      if (client->tail == client->head)
+        client->startup = 0;
+    }
+    spin_unlock(&client->buffer_lock);
   }
+  spin_unlock_irqrestore(&unijoy_js.client_lock, flags);
 
-  source->id = id;
-  source->name = dev->name;
+  wake_up_interruptible(&unijoy_js.wait);
+}
+
+static int unijoy_js_buttons(void) {
+  return min(output.buttons_total, UNIJOY_JS_MAX_BUTTONS);
+}
+
+static int unijoy_js_startup_total(void) {
+  return unijoy_js_buttons() + output.axis_total;
+}
+
+static bool unijoy_js_pending(struct unijoy_js_client *client) {
+  return client->startup < unijoy_js_startup_total() ||
+         client->head != client->tail;
+}
+
+/*
+ * Newly opened (or overrun) clients first receive JS_EVENT_INIT events
+ * describing current state of all buttons and axes, as joydev does.
+ */
+static bool unijoy_js_next(struct unijoy_js_client *client,
+                           struct js_event *event) {
+  int buttons;
+  bool have_event = true;
+
+  spin_lock_irq(&client->buffer_lock);
+
+  buttons = unijoy_js_buttons();
+  if (client->startup < unijoy_js_startup_total()) {
+    event->time = jiffies_to_msecs(jiffies);
+    if (client->startup < buttons) {
+      event->type = JS_EVENT_BUTTON | JS_EVENT_INIT;
+      event->number = client->startup;
+      event->value = output.dst_buttons[client->startup];
+    } else {
+      event->type = JS_EVENT_AXIS | JS_EVENT_INIT;
+      event->number = client->startup - buttons;
+      event->value = output.dst_axis[event->number];
+    }
+    client->startup++;
+  } else if (client->head != client->tail) {
+    *event = client->buffer[client->tail++];
+    client->tail &= UNIJOY_JS_BUFFER_SIZE - 1;
+  } else {
+    have_event = false;
+  }
+
+  spin_unlock_irq(&client->buffer_lock);
+
+  return have_event;
+}
+
+static int unijoy_js_open(struct inode *inode, struct file *file) {
+  struct unijoy_js_client *client;
+
+  if (!unijoy_js.exist)
+    return -ENODEV;
+
+  client = kzalloc(sizeof(struct unijoy_js_client), GFP_KERNEL);
+  if (!client)
+    return -ENOMEM;
+
+  spin_lock_init(&client->buffer_lock);
+
+  spin_lock_irq(&unijoy_js.client_lock);
+  list_add_tail(&client->node, &unijoy_js.client_list);
+  unijoy_js.clients++;
+  if (unijoy_js.clients > unijoy_memory.clients_peak)
+    unijoy_memory.clients_peak = unijoy_js.clients;
+  spin_unlock_irq(&unijoy_js.client_lock);
+
+  file->private_data = client;
+  nonseekable_open(inode, file);
+
+  return 0;
+}
+
+static int unijoy_js_release(struct inode *inode, struct file *file) {
+  struct unijoy_js_client *client = file->private_data;
+
+  spin_lock_irq(&unijoy_js.client_lock);
+  list_del(&client->node);
+  unijoy_js.clients--;
+  spin_unlock_irq(&unijoy_js.client_lock);
+
+  kfree(client);
+
+  return 0;
+}
+
+static ssize_t unijoy_js_read(struct file *file, char __user *buf,
+                              size_t count, loff_t *ppos) {
+  struct unijoy_js_client *client = file->private_data;
+  struct js_event event;
+  ssize_t retval = 0;
+
+  if (!unijoy_js.exist)
+    return -ENODEV;
+
+  if (count < sizeof(struct js_event))
+    return -EINVAL;
 
-  for (i = 0; i < ABS_CNT; i++) {
-    if (test_bit(i, dev->absbit)) {
-      source->axis_map[i] = source->axis_total;
-      source->axis_revmap[source->axis_total] = i;
-      source->axis_total++;
-    }
-  }
+  if (!(file->f_flags & O_NONBLOCK)) {
+    retval = wait_event_interruptible(unijoy_js.wait,
+                                      !unijoy_js.exist ||
+                                      unijoy_js_pending(client));
+    if (retval)
+      return retval;
 
-  for (i = BTN_JOYSTICK - BTN_MISC; i < UNIJOY_MAX_BUTTONS; i++) {
-    if (test_bit(i + BTN_MISC, dev->keybit)) {
-      source->button_map[i] = source->buttons_total;
-      source->button_revmap[source->buttons_total] = i + BTN_MISC;
-      source->buttons_total++;
-    }
+    if (!unijoy_js.exist)
+      return -ENODEV;
   }
 
-  for (i = 0; i < BTN_JOYSTICK - BTN_MISC; i++) {
-    if (test_bit(i + BTN_MISC, dev->keybit)) {
-      source->button_map[i] = source->buttons_total;
-      source->button_revmap[source->buttons_total] = i + BTN_MISC;
-      source->buttons_total++;
-    }
+  while (retval + sizeof(struct js_event) <= count &&
+         unijoy_js_next(client, &event)) {
+    if (copy_to_user(buf + retval, &event, sizeof(struct js_event)))
+      return -EFAULT;
+    retval += sizeof(struct js_event);
   }
 
-  for (i = 0; i < source->axis_total; i++) {
-    j = source->axis_revmap[i];
-    if (input_abs_get_max(dev, j) == input_abs_get_min(dev, j)) {
-      source->corrections[i].type = JS_CORR_NONE;
-      continue;
-    }
+  if (retval == 0 && (file->f_flags & O_NONBLOCK))
+    return -EAGAIN;
 
-    source->corrections[i].type = JS_CORR_BROKEN;
-    source->corrections[i].prec = input_abs_get_fuzz(dev, j);
+  return retval;
+}
 
-    t = (input_abs_get_max(dev, j) + input_abs_get_min(dev, j)) / 2;
-    source->corrections[i].coef[0] = t - input_abs_get_flat(dev, j);
-    source->corrections[i].coef[1] = t + input_abs_get_flat(dev, j);
-    t = (input_abs_get_max(dev, j) - input_abs_get_min(dev, j)) / 2
-      - 2 * input_abs_get_flat(dev, j);
-    if (t) {
-      source->corrections[i].coef[2] = (1 << 29) / t;
-      source->corrections[i].coef[3] = (1 << 29) / t;
-    }
-  }
+static unsigned int unijoy_js_poll(struct file *file, poll_table *wait) {
+  struct unijoy_js_client *client = file->private_data;
 
-  spin_lock(&unijoy_sysfs.sources_lock);
-  INIT_LIST_HEAD(&source->list);
-  list_add(&source->list, &unijoy_sysfs.sources.list);
-  spin_unlock(&unijoy_sysfs.sources_lock);
+  poll_wait(file, &unijoy_js.wait, wait);
 
-  return source;
+  return (unijoy_js_pending(client) ? (POLLIN | POLLRDNORM) : 0) |
+         (unijoy_js.exist ? 0 : (POLLHUP | POLLERR));
 }
 
-static void unijoy_inph_relink(struct unijoy_inph_source *source, __u64 id) {
-  int i;
-  for (i = 0; i < output.buttons_total; i++) {
-    if (output.source_buttons_map[i].id == id) {
-      output.source_buttons_map[i].source = source;
-    }
+static long unijoy_js_ioctl(struct file *file, unsigned int cmd,
+                            unsigned long arg) {
+  void __user *argp = (void __user *)arg;
+  int i, len;
+
+  if (!unijoy_js.exist)
+    return -ENODEV;
+
+  switch (cmd) {
+    case JSIOCGVERSION:
+      return put_user(JS_VERSION, (__u32 __user *)argp);
+    case JSIOCGAXES:
+      return put_user((__u8)output.axis_total, (__u8 __user *)argp);
+    case JSIOCGBUTTONS:
+      return put_user((__u8)unijoy_js_buttons(), (__u8 __user *)argp);
+    case JSIOCGAXMAP:
+      for (i = 0; i < ABS_CNT; i++) {
+        if (put_user((__u8)i, (__u8 __user *)argp + i))
+          return -EFAULT;
+      }
+      return 0;
+    case JSIOCGBTNMAP:
+      for (i = 0; i < UNIJOY_MAX_BUTTONS; i++) {
+        if (put_user((__u16)unijoy_inph_button_code(i),
+                     (__u16 __user *)argp + i))
+          return -EFAULT;
+      }
+      return 0;
   }
-  for (i = 0; i < output.axis_total; i++) {
-    if (output.source_axis_map[i].id == id) {
-      output.source_axis_map[i].source = source;
-    }
+
+  if (_IOC_TYPE(cmd) == 'j' && _IOC_DIR(cmd) == _IOC_READ &&
+      _IOC_NR(cmd) == _IOC_NR(JSIOCGNAME(0))) {
+    len = min_t(int, _IOC_SIZE(cmd), strlen(UNIJOY_NAME) + 1);
+    if (copy_to_user(argp, UNIJOY_NAME, len))
+      return -EFAULT;
+    return len;
   }
+
+  return -EINVAL;
 }
 
-static int unijoy_inph_connect(struct input_handler *handler,
-                               struct input_dev *dev,
-                               const struct input_device_id *in_id) {
-  struct unijoy_inph_source *source;
+#ifdef CONFIG_COMPAT
+static long unijoy_js_compat_ioctl(struct file *file, unsigned int cmd,
+                                   unsigned long arg) {
+  return unijoy_js_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+/* Shared state implementation */
+
+static int unijoy_state_setup(void) {
   int error;
-  __u64 id;
 
-  id = ((long)dev->id.bustype << 48)
-     | ((long)dev->id.vendor  << 32)
-     | ((long)dev->id.product << 16)
-     | ((long)dev->id.version      );
+  BUILD_BUG_ON(ABS_CNT > UNIJOY_STATE_AXES);
+  BUILD_BUG_ON(UNIJOY_MAX_BUTTONS > UNIJOY_STATE_BUTTONS);
 
-  if (id == 0)
-    return 0;
+  unijoy_state = vmalloc_user(PAGE_ALIGN(sizeof(struct unijoy_state)));
+  if (!unijoy_state)
+    return -ENOMEM;
 
-  source = unijoy_sysfs_find(id);
+  error = misc_register(&unijoy_state_misc);
+  if (error) {
+    vfree(unijoy_state);
+    unijoy_state = 0;
+  }
 
-  if (!source) {
-    source = unijoy_inph_create(dev, id);
-    if (!source)
-      return -ENOMEM;
+  return error;
+}
+
+static void unijoy_state_free(void) {
+  misc_deregister(&unijoy_state_misc);
+  vfree(unijoy_state);
+  unijoy_state = 0;
+}
+
+/*
+ * Only unijoy_thread writes the state, so plain sequence counter with
+ * write barriers is enough to let any number of readers sample it
+ * without syscalls.
+ */
+static void unijoy_state_update(int action, int number, int value) {
+  unijoy_state->sequence++;
+  smp_wmb();
+
+  switch (action) {
+    case UNIJOY_ACTION_EMMIT_BUTTON:
+    case UNIJOY_ACTION_REPORT_BUTTON:
+      if (value)
+        unijoy_state->button_bits[number / 64] |= 1ULL << (number % 64);
+      else
+        unijoy_state->button_bits[number / 64] &= ~(1ULL << (number % 64));
+      break;
+    case UNIJOY_ACTION_REPORT_AXIS:
+      unijoy_state->axis[number] = value;
+      break;
+    case UNIJOY_ACTION_REFRESH:
+      unijoy_state->axes = output.axis_total;
+      unijoy_state->buttons = output.buttons_total;
+      break;
   }
 
+  smp_wmb();
+  unijoy_state->sequence++;
+}
 
-  
-  source->handle.dev     = input_get_device(dev);
-  source->handle.handler = handler;
-  source->handle.private = source;
+static int unijoy_state_mmap(struct file *file, struct vm_area_struct *vma) {
+  if (vma->vm_pgoff ||
+      vma->vm_end - vma->vm_start >
+        PAGE_ALIGN(sizeof(struct unijoy_state)))
+    return -EINVAL;
 
-  error = input_register_handle(&source->handle);
+  if (vma->vm_flags & VM_WRITE)
+    return -EPERM;
 
-  if (error)
-    return error;
+  vma->vm_flags &= ~VM_MAYWRITE;
 
-  if (source->state == UNIJOY_SOURCE_DISCONNECTED) {
-    unijoy_inph_relink(source, id);
-    unijoy_sysfs_merge(source);
-  }
+  return remap_vmalloc_range(vma, unijoy_state, 0);
+}
 
-  return 0;
+/* Event tap implementation */
+
+#ifdef CONFIG_UNIJOY_TAP
+
+static int unijoy_tap_setup(void) {
+  spin_lock_init(&unijoy_tap.lock);
+  init_waitqueue_head(&unijoy_tap.wait);
+
+  return misc_register(&unijoy_tap_misc);
 }
 
-static void unijoy_inph_disconnect(struct input_handle *handle) {
-  struct unijoy_inph_source *source = handle->private;
+static void unijoy_tap_free(void) {
+  misc_deregister(&unijoy_tap_misc);
+}
 
-  if (!source)
+/*
+ * Ring exists only while tap is opened, without consumer dispatch path
+ * skips this through patched-out branch of unijoy_tap_write.
+ */
+static void unijoy_tap_record(struct unijoy_inph_source *source,
+                              int type, int code, int slot, int value,
+                              ktime_t time) {
+  struct unijoy_tap_header *header;
+  struct unijoy_tap_record *record;
+  unsigned long flags;
+  __u32 head;
+
+  if (!unijoy_tap.ring)
     return;
 
-  if (source->state == UNIJOY_SOURCE_MERGED) {
-    unijoy_sysfs_suspend(source);
-  } else {
-    unijoy_sysfs_remove(source);
+  spin_lock_irqsave(&unijoy_tap.lock, flags);
+
+  header = unijoy_tap.ring;
+  if (!header)
+    goto unlock_exit;
+
+  /* Consumer is done with the records up to tail before storing it */
+  head = header->head;
+  if (head - smp_load_acquire(&header->tail) >= UNIJOY_TAP_RECORDS) {
+    header->dropped++;
+    goto unlock_exit;
   }
 
-  input_unregister_handle(handle);
-}
+  record = (struct unijoy_tap_record *)
+    ((char *)header + UNIJOY_TAP_HEADER_SIZE) +
+    (head & (UNIJOY_TAP_RECORDS - 1));
+  record->source = source->id;
+  record->time = ktime_to_ns(time);
+  record->value = value;
+  record->type = type;
+  record->code = code;
+  record->slot = slot;
 
-static int unijoy_thread_wakeup_condition(void) {
-  return (output.head != output.tail || output.full)
-      || kthread_should_stop();
+  smp_wmb();
+  header->head = head + 1;
+
+  spin_unlock_irqrestore(&unijoy_tap.lock, flags);
+  wake_up_interruptible(&unijoy_tap.wait);
+  return;
+
+unlock_exit:
+  spin_unlock_irqrestore(&unijoy_tap.lock, flags);
 }
 
-static __u64 unijoy_thread_nextdata(void) {
-  __u64 data = ULLONG_MAX;
+static int unijoy_tap_open(struct inode *inode, struct file *file) {
+  struct unijoy_tap_header *header;
 
-  spin_lock_irq(&output.buffer_lock);
-  data = output.buffer[output.tail++];
-  output.tail &= UNIJOY_BUFFER_SIZE - 1;
-  if (output.full)
-    output.full = false;
-  spin_unlock_irq(&output.buffer_lock);
+  spin_lock_irq(&unijoy_tap.lock);
+  if (unijoy_tap.busy) {
+    spin_unlock_irq(&unijoy_tap.lock);
+    return -EBUSY;
+  }
+  unijoy_tap.busy = true;
+  spin_unlock_irq(&unijoy_tap.lock);
 
-  return data;
-}
+  header = vmalloc_user(UNIJOY_TAP_SIZE);
+  if (!header) {
+    unijoy_tap.busy = false;
+    return -ENOMEM;
+  }
+  header->records = UNIJOY_TAP_RECORDS;
 
-static int unijoy_thread(void *nulldata) {
-  __u64 data;
-  int action;
-  int number;
-  int value;
+  spin_lock_irq(&unijoy_tap.lock);
+  unijoy_tap.ring = header;
+  spin_unlock_irq(&unijoy_tap.lock);
+  unijoy_memory.tap_peak = UNIJOY_TAP_SIZE;
+  static_branch_enable(&unijoy_tap_key);
 
-  while (1) {
-    wait_event_interruptible(output.wait, unijoy_thread_wakeup_condition());
-    
-    if (kthread_should_stop()) 
-      return 0;
+  return nonseekable_open(inode, file);
+}
 
-    while (output.head != output.tail || output.full) {
-      if (kthread_should_stop()) 
-        return 0;
-        
-      data = unijoy_thread_nextdata();
+static int unijoy_tap_release(struct inode *inode, struct file *file) {
+  void *ring;
 
-      if (data == ULLONG_MAX) 
-        continue;
+  static_branch_disable(&unijoy_tap_key);
 
-      action = (int)(data & 0xFFFF);
-      number = (int)((data>>16) & 0xFFFF);
-      value  = (int)(data>>32);
+  spin_lock_irq(&unijoy_tap.lock);
+  ring = unijoy_tap.ring;
+  unijoy_tap.ring = 0;
+  unijoy_tap.busy = false;
+  spin_unlock_irq(&unijoy_tap.lock);
+
+  vfree(ring);
 
-      switch (action) {
-        case UNIJOY_ACTION_EMMIT_BUTTON:
-          input_report_key(output.idev, number, value);
-          input_sync(output.idev);
-          break;
-        case UNIJOY_ACTION_EMMIT_AXIS:
-          input_report_abs(output.idev, number, value);
-          input_sync(output.idev);
-          break;
-        case UNIJOY_ACTION_REFRESH:
-          unijoy_inph_unregister();
-          unijoy_inph_register();
-          break;
-      }
-    }
-  }
   return 0;
 }
 
-static void unijoy_inph_enqueue(__u64 data) {
-  unsigned long flags = 0;
-  if (output.full)
-    goto unlock_exit;
+static int unijoy_tap_mmap(struct file *file, struct vm_area_struct *vma) {
+  if (vma->vm_pgoff || vma->vm_end - vma->vm_start > UNIJOY_TAP_SIZE)
+    return -EINVAL;
 
-  
-  spin_lock_irqsave(&output.buffer_lock, flags);
-  
-  output.buffer[output.head] = data;
+  return remap_vmalloc_range(vma, unijoy_tap.ring, 0);
+}
 
-  output.head++;
-  output.head &= UNIJOY_BUFFER_SIZE - 1;
+static unsigned int unijoy_tap_poll(struct file *file, poll_table *wait) {
+  struct unijoy_tap_header *header = unijoy_tap.ring;
 
-  if (output.head == output.tail )
-    output.full = true;
+  poll_wait(file, &unijoy_tap.wait, wait);
 
-  spin_unlock_irqrestore(&output.buffer_lock, flags);
-unlock_exit:
-  wake_up_interruptible(&output.wait);
+  if (header->head != READ_ONCE(header->tail))
+    return POLLIN | POLLRDNORM;
+
+  return 0;
 }
 
-static void unijoy_inph_event(struct input_handle *handle,
-                              unsigned int type,
-                              unsigned int code,
-                              int value) {
+#endif
 
-  struct unijoy_inph_source *source = handle->private;
-  int number;
-  __u64 data;
-  int i;
-  int subcode;
+/* Watchdog implementation */
 
-  if (!source)
+static void unijoy_watchdog_setup(void) {
+  if (!unijoy_watchdog_ms)
     return;
 
-  switch (type) {
-    case EV_KEY:
-      if (code < BTN_MISC || value == 2)
-        return;
-      number = source->button_map[code - BTN_MISC];
-      for (i = 0; i < output.buttons_total; i++) {
-        if (output.source_buttons_map[i].source == source &&
-            output.source_buttons_map[i].value == number) {
-          subcode = i+BTN_JOYSTICK;
-          if (subcode >= KEY_MAX) {
-            subcode = i+BTN_MISC;
-          }
-          data = ((__u64)((__u32)value)<<32)
-               | ((__u16)subcode<<16)
-               | ((__u16)UNIJOY_ACTION_EMMIT_BUTTON);
-          unijoy_inph_enqueue(data);
-        }
-      }
-      break;
-    case EV_ABS:
-      number = source->axis_map[code];
-      value = unijoy_inph_correct(value, &source->corrections[number]);
-      for (i = 0; i < output.axis_total; i++) {
-        if (output.source_axis_map[i].source == source &&
-            output.source_axis_map[i].value == number) {
-          data = ((__u64)((__u32)value)<<32)
-               | ((__u16)i<<16)
-               | ((__u16)UNIJOY_ACTION_EMMIT_AXIS);
-          unijoy_inph_enqueue(data);
-        }
-      }
-      break;
-    default:
-      return;
-  }
+  INIT_WORK(&unijoy_watchdog.work, unijoy_watchdog_work);
+  hrtimer_init(&unijoy_watchdog.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  unijoy_watchdog.timer.function = unijoy_watchdog_tick;
+  hrtimer_start(&unijoy_watchdog.timer,
+                ns_to_ktime((u64)unijoy_watchdog_ms * NSEC_PER_MSEC),
+                HRTIMER_MODE_REL);
 }
 
-static void unijoy_inph_refresh(void) {
-  unijoy_inph_enqueue((__u64)((__u16)UNIJOY_ACTION_REFRESH));
+static void unijoy_watchdog_free(void) {
+  if (!unijoy_watchdog_ms)
+    return;
+
+  hrtimer_cancel(&unijoy_watchdog.timer);
+  unijoy_watchdog.health = UNIJOY_HEALTH_OK;
+
+  unijoy_watchdog.stopped = true;
+  synchronize_rcu();
+  cancel_work_sync(&unijoy_watchdog.work);
 }
 
-static void unijoy_inph_unregister(void) {
-  if (output.idev) {
-    input_unregister_device(output.idev);
-    input_free_device(output.idev);
-    output.idev = 0;
+/*
+ * Worker is stalled when events were waiting for it on two ticks in a
+ * row and it did not drain any of them in between. Idle worker is never
+ * suspected: it polls axis lane only every UNIJOY_IDLE_POLL, which may
+ * well be longer than watchdog_ms, and anything else resumes it first.
+ */
+static enum hrtimer_restart unijoy_watchdog_tick(struct hrtimer *timer) {
+  unsigned long drains = READ_ONCE(output.drains);
+  bool pending = unijoy_thread_pending() && !READ_ONCE(output.idle);
+  s64 now = ktime_to_ns(ktime_get());
+  s64 stalled;
+
+  if (pending && unijoy_watchdog.pending_seen &&
+      drains == unijoy_watchdog.drains_seen) {
+    if (unijoy_watchdog.health == UNIJOY_HEALTH_OK) {
+      unijoy_watchdog.health = UNIJOY_HEALTH_STALLED;
+      unijoy_watchdog.stalled_since = now -
+        (s64)unijoy_watchdog_ms * NSEC_PER_MSEC;
+      unijoy_watchdog.stalls++;
+      unijoy_watchdog_kick();
+    }
+    stalled = now - unijoy_watchdog.stalled_since;
+    if (stalled > unijoy_watchdog.stall_max)
+      unijoy_watchdog.stall_max = stalled;
+    pr_warn_ratelimited("unijoy: worker stalled for %lld ms, "
+                        "main lane depth %d, axis lane depth %d\n",
+                        div_s64(stalled, NSEC_PER_MSEC),
+                        output.full ? UNIJOY_BUFFER_SIZE :
+                          (output.head - output.tail) &
+                            (UNIJOY_BUFFER_SIZE - 1),
+                        output.axis_pending_count);
+  } else if (unijoy_watchdog.health == UNIJOY_HEALTH_STALLED) {
+    unijoy_watchdog.health = UNIJOY_HEALTH_OK;
+    pr_info("unijoy: worker recovered after %lld ms\n",
+            div_s64(now - unijoy_watchdog.stalled_since, NSEC_PER_MSEC));
   }
+
+  unijoy_watchdog.pending_seen = pending;
+  unijoy_watchdog.drains_seen = drains;
+
+  hrtimer_forward_now(timer,
+                      ns_to_ktime((u64)unijoy_watchdog_ms * NSEC_PER_MSEC));
+  return HRTIMER_RESTART;
 }
-static void unijoy_inph_register(void) {
-  int i;
-  struct input_dev *idev = 0;
 
-  if (output.axis_total <0 && output.buttons_total < 0)
+/*
+ * Degraded path is taken from dispatch, behaviour timers and sysfs alike,
+ * so the work is queued under RCU read lock, unijoy_watchdog_free waits
+ * for it before cancelling the work for good.
+ */
+static void unijoy_watchdog_kick(void) {
+  if (!unijoy_degraded_direct)
     return;
 
-  idev = input_allocate_device();
-  idev->name = "unijoy v0.3";
-  input_alloc_absinfo(idev);
+  rcu_read_lock();
+  if (!READ_ONCE(unijoy_watchdog.stopped))
+    queue_work(system_highpri_wq, &unijoy_watchdog.work);
+  rcu_read_unlock();
+}
 
-  if (output.buttons_total > 0) {
-    set_bit(EV_KEY, idev->evbit);
-    for (i = 0; i < output.buttons_total; i++) {
-      if (i+BTN_JOYSTICK < KEY_MAX) {
-        set_bit(i+BTN_JOYSTICK, idev->keybit);
-      } else {
-        set_bit((i+BTN_JOYSTICK) - KEY_MAX + BTN_MISC, idev->keybit);
-      }
-    }
-  }
+/*
+ * Drains lanes in place of stalled worker, in the same order and through
+ * the same path, so state page keeps up. Worker holding emit_lock is
+ * stuck re-registering virtual device (or is just back), either way the
+ * work leaves lanes to it.
+ */
+static void unijoy_watchdog_work(struct work_struct *work) {
+  if (!mutex_trylock(&output.emit_lock))
+    return;
 
-  if (output.axis_total > 0) {
-    set_bit(EV_ABS, idev->evbit);
-    for (i = 0; i < output.axis_total; i++) {
-      set_bit(i, idev->absbit);
-    }
+  while (unijoy_thread_pending() &&
+         unijoy_watchdog.health == UNIJOY_HEALTH_STALLED) {
+    unijoy_thread_step();
+    unijoy_watchdog.direct++;
   }
 
-  if (input_register_device(idev)) {
-    input_free_device(idev);
-  } else {
-    output.idev = idev;
+  mutex_unlock(&output.emit_lock);
+}
+
+/* Memory accounting implementation */
+
+static void unijoy_memory_setup(void) {
+  unijoy_memory.dir = debugfs_create_dir("unijoy", 0);
+  debugfs_create_file("memory", 0444, unijoy_memory.dir, 0,
+                      &unijoy_memory_fops);
+}
+
+static void unijoy_memory_free(void) {
+  debugfs_remove_recursive(unijoy_memory.dir);
+}
+
+/*
+ * Everything but sources, js clients and tap ring is static and sized
+ * upon build. Total peak sums peaks of categories, so it is an upper
+ * bound rather than a value module ever actually had.
+ */
+static int unijoy_memory_show(struct seq_file *m, void *unused) {
+  struct unijoy_inph_source *source;
+  int states[UNIJOY_SOURCE_DISCONNECTED + 1] = { 0 };
+  size_t sources, clients, fixed, tap = 0;
+  size_t sources_peak, clients_peak, tap_peak = 0;
+
+  spin_lock(&unijoy_sysfs.sources_lock);
+  list_for_each_entry(source, &unijoy_sysfs.sources.list, list) {
+    states[source->state]++;
   }
+  spin_unlock(&unijoy_sysfs.sources_lock);
+
+  sources = unijoy_memory.sources * sizeof(struct unijoy_inph_source);
+  sources_peak = unijoy_memory.sources_peak *
+                 sizeof(struct unijoy_inph_source);
+  clients = unijoy_js.clients * sizeof(struct unijoy_js_client);
+  clients_peak = unijoy_memory.clients_peak * sizeof(struct unijoy_js_client);
+#ifdef CONFIG_UNIJOY_TAP
+  tap = unijoy_tap.ring ? UNIJOY_TAP_SIZE : 0;
+  tap_peak = unijoy_memory.tap_peak;
+#endif
+  fixed = sizeof(output) + sizeof(unijoy_js) + sizeof(struct kobject) +
+          PAGE_ALIGN(sizeof(struct unijoy_state));
+
+  seq_printf(m, "sources online %d merged %d disconnected %d peak %d\n",
+             states[UNIJOY_SOURCE_ONLINE], states[UNIJOY_SOURCE_MERGED],
+             states[UNIJOY_SOURCE_DISCONNECTED], unijoy_memory.sources_peak);
+  seq_printf(m, "source_bytes %zu sources_bytes %zu peak %zu\n",
+             sizeof(struct unijoy_inph_source), sources, sources_peak);
+  seq_printf(m, "output source_axis_map %zu source_buttons_map %zu "
+                "buffer %zu axis_lane %zu filters %zu trims %zu "
+                "behaviours %zu programs %zu shares %zu motions %zu "
+                "total %zu\n",
+             sizeof(output.source_axis_map),
+             sizeof(output.source_buttons_map),
+             sizeof(output.buffer),
+             sizeof(output.axis_pending) + sizeof(output.axis_value) +
+               sizeof(output.axis_time),
+             sizeof(output.filters), sizeof(output.trims),
+             sizeof(output.behaviours), sizeof(output.programs),
+             sizeof(output.shares), sizeof(output.motions),
+             sizeof(output));
+  seq_printf(m, "js_device %zu clients %d client_bytes %zu "
+                "clients_bytes %zu peak %zu\n",
+             sizeof(unijoy_js), unijoy_js.clients,
+             sizeof(struct unijoy_js_client), clients, clients_peak);
+  seq_printf(m, "state_page %lu\n", PAGE_ALIGN(sizeof(struct unijoy_state)));
+  seq_printf(m, "tap_ring %zu peak %zu\n", tap, tap_peak);
+  seq_printf(m, "total %zu peak %zu\n",
+             fixed + sources + clients + tap,
+             fixed + sources_peak + clients_peak + tap_peak);
+
+  return 0;
+}
+
+static int unijoy_memory_open(struct inode *inode, struct file *file) {
+  return single_open(file, unijoy_memory_show, 0);
 }
 
 /* Main entry points */
@@ -922,27 +4610,73 @@ int __init unijoy_init(void) {
   if (error)
     return error;
 
+  error = unijoy_inph_allowlist();
+
+  if (error)
+    goto err_free_sysfs;
+
   error = input_register_handler(&unijoy_inph);
 
   if (error)
     goto err_free_sysfs; 
 
+  if (unijoy_keyboards) {
+    error = input_register_handler(&unijoy_inph_kbd);
+
+    if (error)
+      goto err_unregister_handler;
+  }
+
+  error = unijoy_js_setup();
+
+  if (error)
+    goto err_unregister_kbd;
+
+  error = unijoy_state_setup();
+
+  if (error)
+    goto err_free_js;
+
+  error = unijoy_tap_setup();
+
+  if (error)
+    goto err_free_state;
+
   for (i = 0; i < ABS_CNT; i++) {
     output.source_axis_map[i].id = ULLONG_MAX;
   }
   for (i = 0; i < UNIJOY_MAX_BUTTONS; i++) {
     output.source_buttons_map[i].id = ULLONG_MAX;
+    hrtimer_init(&output.behaviours[i].timer, CLOCK_MONOTONIC,
+                 HRTIMER_MODE_REL);
+    output.behaviours[i].timer.function = unijoy_inph_behaviour_timer;
   }
 
   unijoy_inph_register();
   spin_lock_init(&output.buffer_lock);
+  spin_lock_init(&output.behaviour_lock);
+  spin_lock_init(&output.program_lock);
+  spin_lock_init(&output.share_lock);
+  mutex_init(&output.emit_lock);
+  output.active_at = jiffies;
   init_waitqueue_head(&output.wait);
   output.thread = kthread_create(unijoy_thread,0,"unijoy_thread");
 
   wake_up_process(output.thread);  
+  unijoy_watchdog_setup();
+  unijoy_memory_setup();
 
   return 0;
   
+err_free_state:
+  unijoy_state_free();
+err_free_js:
+  unijoy_js_free();
+err_unregister_kbd:
+  if (unijoy_keyboards)
+    input_unregister_handler(&unijoy_inph_kbd);
+err_unregister_handler:
+  input_unregister_handler(&unijoy_inph);
 err_free_sysfs:
   unijoy_sysfs_free();
   
@@ -950,9 +4684,23 @@ err_free_sysfs:
 }
 
 void __exit unijoy_exit(void) {
+  int i;
+
+  unijoy_memory_free();
+
+  for (i = 0; i < UNIJOY_MAX_BUTTONS; i++) {
+    output.behaviours[i].type = UNIJOY_BEHAVIOUR_NONE;
+    hrtimer_cancel(&output.behaviours[i].timer);
+  }
+  unijoy_watchdog_free();
   kthread_stop(output.thread);
   unijoy_inph_unregister();
+  if (unijoy_keyboards)
+    input_unregister_handler(&unijoy_inph_kbd);
   input_unregister_handler(&unijoy_inph);
+  unijoy_tap_free();
+  unijoy_state_free();
+  unijoy_js_free();
   unijoy_sysfs_free();
 }
 
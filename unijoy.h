@@ -0,0 +1,70 @@
+/**
+ * Structures shared between unijoy module and userspace consumers
+ * through mmap-able devices.
+ */
+
+#ifndef UNIJOY_H
+#define UNIJOY_H
+
+#include <linux/types.h>
+
+#define UNIJOY_STATE_AXES 64
+#define UNIJOY_STATE_BUTTONS 512
+
+/*
+ * Current state of virtual device, served read-only by /dev/unijoy_state.
+ *
+ * Sequence is odd while state is being updated. Readers should sample it
+ * before and after copying state out and retry if it was odd or changed
+ * in between. Weakly ordered CPUs (ARM) need acquire ordering for that,
+ * a compiler barrier is not enough:
+ *
+ *   do {
+ *     seq = __atomic_load_n(&state->sequence, __ATOMIC_ACQUIRE);
+ *     copy = *state;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *   } while ((seq & 1) ||
+ *            seq != __atomic_load_n(&state->sequence, __ATOMIC_RELAXED));
+ */
+struct unijoy_state {
+  __u32 sequence;
+  __u32 axes;
+  __u32 buttons;
+  __u32 reserved;
+  __s32 axis[UNIJOY_STATE_AXES];
+  __u64 button_bits[UNIJOY_STATE_BUTTONS / 64];
+};
+
+#define UNIJOY_TAP_RECORDS 4096
+
+/*
+ * Event tap served by /dev/unijoy_tap. Mapping starts with one page
+ * holding the header, followed by UNIJOY_TAP_RECORDS records.
+ *
+ * Module appends records at head, consumer processes records from tail
+ * up to head (both are free-running, index is taken modulo number of
+ * records) and then stores new tail, with release ordering, so module
+ * does not overwrite records still being read (head is loaded with
+ * acquire ordering likewise). If ring is full, records are not
+ * written and dropped counter is increased instead. poll() reports
+ * readability while head differs from tail.
+ */
+struct unijoy_tap_header {
+  __u32 head;
+  __u32 tail;
+  __u32 records;
+  __u32 reserved;
+  __u64 dropped;
+};
+
+struct unijoy_tap_record {
+  __u64 source;     /* id of source device */
+  __u64 time;       /* CLOCK_MONOTONIC timestamp, ns */
+  __s32 value;      /* value sent to destination */
+  __u16 type;       /* EV_KEY or EV_ABS */
+  __u16 code;       /* event code on source device */
+  __u16 slot;       /* destination button or axis number */
+  __u16 reserved[3];
+};
+
+#endif